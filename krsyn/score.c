@@ -8,6 +8,68 @@
 #include <stdlib.h>
 #include <malloc.h>
 
+#ifdef KS_HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+/**
+  * @struct ks_score_voice_job
+  * @brief Notes of a channel rendered together, mono is decided in order of notes as the single threaded render.
+*/
+typedef struct ks_score_voice_job{
+    u32                     indices         [KS_SYNTH_MAX_LANES];
+    u8                      num_notes;
+    u8                      channel;
+    bool                    mono;
+}ks_score_voice_job;
+
+/**
+  * @struct ks_score_bus
+  * @brief Private copy of channel buses of a worker, added to channels after all jobs.
+*/
+typedef struct ks_score_bus{
+    ks_synth_render_buffer  *render_buffer;
+    i32                     *output_logs    [KS_NUM_CHANNELS];  // KS_SYNTH_TILE_FRAMES * 2 samples
+    i32                     *mono_logs      [KS_NUM_CHANNELS];  // KS_SYNTH_TILE_FRAMES samples
+    u32                     output_used;                        // bits of channels
+    u32                     mono_used;
+    u32                     retired_voices;
+}ks_score_bus;
+
+typedef struct ks_score_worker{
+    ks_score_workers        *pool;
+    ks_score_bus            bus;
+#ifdef KS_HAVE_PTHREAD
+    pthread_t               thread;
+#endif
+}ks_score_worker;
+
+/**
+  * @struct ks_score_workers
+  * @brief Threads which render jobs of a tile with the caller's thread.
+*/
+struct ks_score_workers{
+    u32                     num_workers;                        // without the caller's thread
+    ks_score_worker         *workers;
+
+    ks_score_voice_job      *jobs;                              // ks_1(polyphony_bits), a job has one note at least
+    u32                     num_jobs;
+    u32                     next_job;
+
+    const ks_synth_context  *ctx;
+    ks_score_state          *state;
+    u32                     frame;
+
+#ifdef KS_HAVE_PTHREAD
+    pthread_mutex_t         mutex;
+    pthread_cond_t          start;
+    pthread_cond_t          finish;
+    u32                     generation;
+    u32                     running;
+    bool                    quit;
+#endif
+};
+
 
 ks_io_begin_custom_func(ks_score_event)
     ks_func_prop(ks_io_variable_length_number, ks_prop_u32(delta));
@@ -59,12 +121,233 @@ KS_INLINE  bool ks_score_note_is_on(const ks_score_note* note){
     return ks_synth_note_is_on(&note->note);
 }
 
-inline bool ks_score_note_info_equals(ks_score_note_info i1, ks_score_note_info i2){
-    return (((i1.channel)<<8) + i1.note_number) == (((i2.channel)<<8) + i2.note_number);
+KS_INLINE bool ks_score_state_voice_is_enabled(const ks_score_state* state, u32 index){
+    return state->voices.states[index] != KS_ENVELOPE_OFF;
+}
+
+KS_INLINE static bool ks_score_state_voice_is_on(const ks_score_state* state, u32 index){
+    return (state->voices.states[index] & 0x7f) != 0;
+}
+
+// call after a note is changed
+KS_INLINE static void ks_score_state_voice_update(ks_score_state* state, u32 index){
+    state->voices.states[index] = state->notes[index].note.envelopes[0].state;
+}
+
+// all notes are free
+static void ks_score_state_voices_reset(ks_score_state* state){
+    ks_score_voice_pool* voices = &state->voices;
+    const u32 num_voices = ks_1(state->polyphony_bits);
+
+    memset(voices->states, KS_ENVELOPE_OFF, num_voices * sizeof(u8));
+    memset(voices->infos, 0, num_voices * sizeof(ks_score_note_info));
+    voices->num_actives = 0;
+    // lower indices are taken first
+    for(u32 i=0; i<num_voices; i++){
+        voices->frees[i] = num_voices - 1 - i;
+    }
+    voices->num_frees = num_voices;
+    for(u32 i=0; i<KS_NUM_CHANNELS * KS_NUM_NOTES; i++){
+        voices->key_voices[i] = num_voices;
+    }
+    voices->next_serial = 0;
+    voices->rendered_serial = 0;
+    memset(voices->channel_voices, 0, sizeof(voices->channel_voices));
+}
+
+// call for a note removed from actives
+KS_INLINE static void ks_score_state_voice_free(ks_score_state* state, u32 index){
+    state->voices.frees[state->voices.num_frees++] = index;
+    state->voices.channel_voices[state->voices.infos[index].channel] --;
+}
+
+// moves notes ended after the last render from actives to frees, the render does it by itself
+static void ks_score_state_voices_collect(ks_score_state* state){
+    ks_score_voice_pool* voices = &state->voices;
+    u32 num_actives = 0;
+    for(u32 a=0; a<voices->num_actives; a++){
+        const u32 p = voices->actives[a];
+        if(ks_score_state_voice_is_enabled(state, p)){
+            voices->actives[num_actives++] = p;
+        } else {
+            ks_score_state_voice_free(state, p);
+        }
+    }
+    voices->num_actives = num_actives;
+}
+
+// envelope level with channel volume, in KS_ENVELOPE_BITS.
+// the level is the larger of now and the point it moves to, so that notes in attack, or not rendered yet, are not quiet
+KS_INLINE static u32 ks_score_state_voice_gain(const ks_score_state* state, u32 index){
+    const ks_synth_note_envelope* envelope = &state->notes[index].note.envelopes[0];
+    const u32 amp = MAX(abs(envelope->now_amp), abs(envelope->now_point_amp));
+    return ((u64)amp * state->channels[state->voices.infos[index].channel].volume_cache) >> KS_VOLUME_BITS;
+}
+
+// true if the note is triggered or retriggered after the last block
+KS_INLINE static bool ks_score_state_voice_is_fresh(const ks_score_state* state, u32 index){
+    return (i32)(state->voices.serials[index] - state->voices.rendered_serial) >= 0;
+}
+
+// k-th largest value of values, 0 is the largest. values are reordered.
+static u32 ks_score_select_gain(u32* values, u32 num_values, u32 k){
+    u32 begin = 0, end = num_values;
+    while(end - begin > 1){
+        const u32 pivot = values[begin + ((end - begin) >> 1)];
+        u32 lt = begin, i = begin, gt = end;
+        // [begin, lt) > pivot, [lt, i) == pivot, [gt, end) < pivot
+        while(i < gt){
+            const u32 v = values[i];
+            if(v > pivot){
+                values[i++] = values[lt];
+                values[lt++] = v;
+            } else if(v < pivot){
+                values[i] = values[--gt];
+                values[gt] = v;
+            } else {
+                i++;
+            }
+        }
+        if(k < lt){
+            end = lt;
+        } else if(k < gt){
+            return pivot;
+        } else {
+            begin = gt;
+        }
+    }
+    return values[begin];
+}
+
+// gain of the quietest audible note under voice_budget, and how many notes of the gain are audible.
+// fresh notes are always audible and take the budget first.
+// returns false if notes of channels not muted are in the budget
+static bool ks_score_state_find_budget(ks_score_state* state, u32* gain, u32* ties){
+    ks_score_voice_pool* voices = &state->voices;
+    u32 num_gains = 0, num_fresh = 0;
+    for(u32 a=0; a<voices->num_actives; a++){
+        const u32 p = voices->actives[a];
+        if(!ks_score_state_voice_is_enabled(state, p) || (state->muted_channels & ks_1(voices->infos[p].channel))) continue;
+        if(ks_score_state_voice_is_fresh(state, p)){
+            num_fresh ++;
+            continue;
+        }
+        voices->gains[num_gains++] = ks_score_state_voice_gain(state, p);
+    }
+    if(num_gains + num_fresh <= state->voice_budget) return false;
+    if(num_fresh >= state->voice_budget){
+        *gain = UINT32_MAX;
+        *ties = 0;
+        return true;
+    }
+
+    const u32 budget = state->voice_budget - num_fresh;
+    *gain = ks_score_select_gain(voices->gains, num_gains, budget - 1);
+    *ties = budget;
+    for(u32 g=0; g<num_gains; g++){
+        if(voices->gains[g] > *gain){
+            (*ties) --;
+        }
+    }
+    return true;
+}
+
+// note to be stolen by steal_policy, from notes of the channel if it is less than KS_NUM_CHANNELS.
+// returns ks_1(polyphony_bits) if not found
+static u32 ks_score_state_find_victim(const ks_score_state* state, u32 channel){
+    const ks_score_voice_pool* voices = &state->voices;
+    u32 victim = ks_1(state->polyphony_bits);
+    u64 victim_key = UINT64_MAX;
+
+    for(u32 a=0; a<voices->num_actives; a++){
+        const u32 p = voices->actives[a];
+        const u8 ch = voices->infos[p].channel;
+        if(channel < KS_NUM_CHANNELS && ch != channel) continue;
+
+        // smaller is older
+        const u64 age = (u32)(voices->serials[p] - voices->next_serial);
+        const u64 on = ks_score_state_voice_is_on(state, p);
+        u64 key;
+        switch (state->steal_policy) {
+        case KS_SCORE_STEAL_QUIETEST:{
+            key = ((u64)ks_score_state_voice_gain(state, p) << 32) | age;
+            break;
+        }
+        case KS_SCORE_STEAL_LOWEST_PRIORITY:
+            key = ((u64)state->channel_priorities[ch] << 33) | (on << 32) | age;
+            break;
+        default:
+            key = (on << 32) | age;
+            break;
+        }
+
+        if(key < victim_key){
+            victim_key = key;
+            victim = p;
+        }
+    }
+    return victim;
 }
 
-inline i16 ks_score_note_info_hash(ks_score_note_info id){
-    return id.note_number +  id.channel;
+// releases notes of the channel in the choke group of the note number, except of the note number
+static void ks_score_state_choke(ks_score_state* state, const ks_synth_context* ctx, u8 channel_number, u8 note_number){
+    const ks_score_voice_pool* voices = &state->voices;
+    const u8 group = state->choke_groups[note_number];
+    const u32 frames = ctx->sampling_rate * KS_SCORE_CHOKE_MSEC / 1000;
+
+    for(u32 a=0; a<voices->num_actives; a++){
+        const u32 p = voices->actives[a];
+        const ks_score_note_info info = voices->infos[p];
+        if(info.channel != channel_number || info.note_number == note_number || state->choke_groups[info.note_number] != group) continue;
+        if(!ks_score_state_voice_is_enabled(state, p)) continue;
+
+        ks_synth_note_choke(&state->notes[p].note, frames);
+        ks_score_state_voice_update(state, p);
+    }
+}
+
+// stops a note immediately for a new note, the note stays in actives and is reused
+static void ks_score_state_steal_voice(ks_score_state* state, u32 index){
+    state->notes[index].note.envelopes[0].state = KS_ENVELOPE_OFF;
+    ks_score_state_voice_update(state, index);
+    state->voices.channel_voices[state->voices.infos[index].channel] --;
+    state->stolen_voices ++;
+}
+
+KS_INLINE static u32 ks_score_note_info_key(ks_score_note_info id){
+    return id.channel * KS_NUM_NOTES + id.note_number;
+}
+
+// index of the note keyed on by id, ks_1(polyphony_bits) if not found
+KS_INLINE static u32 ks_score_state_find_voice(const ks_score_state* state, ks_score_note_info id){
+    const u32 num_voices = ks_1(state->polyphony_bits);
+    const u32 index = state->voices.key_voices[ks_score_note_info_key(id)];
+    if(index == num_voices ||
+       !ks_score_note_info_equals(state->voices.infos[index], id) || !ks_score_state_voice_is_on(state, index)){
+        return num_voices;
+    }
+    return index;
+}
+
+// call after a note is enabled
+static void ks_score_state_voice_activate(ks_score_state* state, u32 index){
+    ks_score_voice_pool* voices = &state->voices;
+    u32 begin = 0, end = voices->num_actives;
+    while(begin < end){
+        const u32 mid = (begin + end) >> 1;
+        if(voices->actives[mid] < index){
+            begin = mid + 1;
+        } else {
+            end = mid;
+        }
+    }
+    memmove(voices->actives + begin + 1, voices->actives + begin, (voices->num_actives - begin) * sizeof(u32));
+    voices->actives[begin] = index;
+    voices->num_actives ++;
+}
+
+inline bool ks_score_note_info_equals(ks_score_note_info i1, ks_score_note_info i2){
+    return (((i1.channel)<<8) + i1.note_number) == (((i2.channel)<<8) + i2.note_number);
 }
 
 inline ks_score_note_info ks_score_note_info_of(u8 note_number, u8 channel){
@@ -129,17 +412,53 @@ ks_score_state* ks_score_state_new(u32 polyphony_bits){
     ks_score_state* ret = calloc(1, sizeof(ks_score_state) + ks_1(polyphony_bits)* sizeof(ks_score_note));
     ks_vector_init(&ret->effects);
     ret->polyphony_bits = polyphony_bits;
+    ret->render_buffer = ks_synth_render_buffer_new(KS_SYNTH_TILE_FRAMES, KS_SYNTH_MAX_LANES);
+    ret->voices.states = calloc(ks_1(polyphony_bits), sizeof(u8));
+    ret->voices.infos = calloc(ks_1(polyphony_bits), sizeof(ks_score_note_info));
+    ret->voices.actives = malloc(ks_1(polyphony_bits) * sizeof(u32));
+    ret->voices.frees = malloc(ks_1(polyphony_bits) * sizeof(u32));
+    ret->voices.serials = calloc(ks_1(polyphony_bits), sizeof(u32));
+    ret->voices.gains = malloc(ks_1(polyphony_bits) * sizeof(u32));
+    ret->steal_policy = KS_SCORE_STEAL_OLDEST_RELEASED;
+    ret->retrigger = KS_SCORE_RETRIGGER_NONE;
+    ks_score_state_voices_reset(ret);
 
     return ret;
 }
 
+void ks_score_state_set_gs_percussion(ks_score_state* state){
+    state->retrigger = KS_SCORE_RETRIGGER_PERCUSSION;
+    memset(state->choke_groups, 0, sizeof(state->choke_groups));
+    // exclusive classes of GS drum sets : hi-hats, whistles, guiros, cuicas and triangles
+    state->choke_groups[42] = state->choke_groups[44] = state->choke_groups[46] = 1;
+    state->choke_groups[71] = state->choke_groups[72] = 2;
+    state->choke_groups[73] = state->choke_groups[74] = 3;
+    state->choke_groups[78] = state->choke_groups[79] = 4;
+    state->choke_groups[80] = state->choke_groups[81] = 5;
+}
+
+static void ks_score_workers_free(ks_score_workers* pool);
+
 void ks_score_state_free(ks_score_state* state){
+    if(state->workers != NULL){
+        ks_score_workers_free(state->workers);
+    }
     for(unsigned i = 0; i< KS_NUM_CHANNELS; i++){
         if(state->channels[i].output_log != NULL){
             free(state->channels[i].output_log);
         }
+        if(state->channels[i].mono_log != NULL){
+            free(state->channels[i].mono_log);
+        }
     }
     ks_effect_list_data_free(state->effects.length, state->effects.data);
+    ks_synth_render_buffer_free(state->render_buffer);
+    free(state->voices.states);
+    free(state->voices.infos);
+    free(state->voices.actives);
+    free(state->voices.frees);
+    free(state->voices.serials);
+    free(state->voices.gains);
     free(state);
 }
 
@@ -151,30 +470,62 @@ bool ks_score_state_note_on(ks_score_state* state, const ks_synth_context* ctx,
          return false;
      }
 
+    const u32 num_voices = ks_1(state->polyphony_bits);
     ks_score_note_info id =ks_score_note_info_of(note_number, channel_number);
-    u16 id_v = ks_score_note_info_hash(id);
-    u16 begin = ks_mask(id_v, state->polyphony_bits);
-    u16 index = begin;
-    while(ks_score_note_is_enabled(&state->notes[index])){
-        // if found same channel and notenumber note, note off
-        if(ks_score_note_info_equals(id, state->notes[index].info)){
-            ks_synth_note_off(&state->notes[index].note);
+    const bool percussion = channel->bank->bank_number.percussion;
+    if(percussion) {
+        synth += note_number;
+        if(state->choke_groups[note_number] != 0){
+            ks_score_state_choke(state, ctx, channel_number, note_number);
         }
+    }
+
+    const u32 last = state->voices.key_voices[ks_score_note_info_key(id)];
+    if(last != num_voices && ks_score_note_info_equals(state->voices.infos[last], id) && ks_score_state_voice_is_enabled(state, last)){
+        // same channel and note number note is still sounding, restart it in place
+        if(state->retrigger == KS_SCORE_RETRIGGER_ALL || (state->retrigger == KS_SCORE_RETRIGGER_PERCUSSION && percussion)){
+            state->voices.serials[last] = state->voices.next_serial++;
+            ks_synth_note_retrigger(&state->notes[last].note, synth, ctx, note_number, velocity);
+            ks_score_state_voice_update(state, last);
+            return true;
+        }
+        // or note off if it is on
+        if(ks_score_state_voice_is_on(state, last)){
+            ks_synth_note_off(&state->notes[last].note);
+            ks_score_state_voice_update(state, last);
+        }
+    }
 
-        index++;
-        index = ks_mask(index, state->polyphony_bits);
+    // a note over the limit of the channel, or over the pool, replaces a note
+    const u16 limit = state->channel_voice_limits[channel_number];
+    bool over_limit = limit != 0 && state->voices.channel_voices[channel_number] >= limit;
+    if(over_limit || state->voices.num_frees == 0){
+        ks_score_state_voices_collect(state);
+        over_limit = limit != 0 && state->voices.channel_voices[channel_number] >= limit;
+    }
 
-        if(index == begin) {
-            ks_warning("Note on failed for exceeded maximum of polyphony at tick %d", channel_number, state->current_tick);
+    u32 index;
+    if(over_limit || state->voices.num_frees == 0) {
+        index = num_voices;
+        if(state->steal_policy != KS_SCORE_STEAL_NONE){
+            index = ks_score_state_find_victim(state, over_limit ? channel_number : KS_NUM_CHANNELS);
+        }
+        if(index == num_voices){
+            ks_warning("Note on failed for exceeded maximum of polyphony at tick %d", state->current_tick);
             return false;
         }
+        ks_score_state_steal_voice(state, index);
+    } else {
+        index = state->voices.frees[--state->voices.num_frees];
+        ks_score_state_voice_activate(state, index);
     }
-    if(channel->bank->bank_number.percussion) {
-        synth += note_number;
 
-    }
-    state->notes[index].info = id;
+    state->voices.infos[index] = id;
+    state->voices.key_voices[ks_score_note_info_key(id)] = index;
+    state->voices.serials[index] = state->voices.next_serial++;
+    state->voices.channel_voices[channel_number] ++;
     ks_synth_note_on(&state->notes[index].note, synth, ctx, note_number, velocity);
+    ks_score_state_voice_update(state, index);
 
     return true;
 }
@@ -192,19 +543,14 @@ bool ks_score_state_note_off(ks_score_state* state, u8 channel_number,  u8 note_
         return false;
     }
     ks_score_note_info info =ks_score_note_info_of(note_number, channel_number);
-    u16 hash = ks_score_note_info_hash(info);
-    u16 begin = ks_mask(hash, state->polyphony_bits);
-    u16 index = begin;
-    while(!ks_score_note_info_equals(state->notes[index].info, info) || !ks_score_note_is_on(&state->notes[index])) {
-        index++;
-        index = ks_mask(index, state->polyphony_bits);
-        if(index == begin) {
-            ks_warning("Note off Failed for not found note with note number %d and channel %d at tick %d", note_number, channel_number, state->current_tick);
-            return false;
-        }
+    const u32 index = ks_score_state_find_voice(state, info);
+    if(index == (u32)ks_1(state->polyphony_bits)) {
+        ks_warning("Note off Failed for not found note with note number %d and channel %d at tick %d", note_number, channel_number, state->current_tick);
+        return false;
     }
 
     ks_synth_note_off(&state->notes[index].note);
+    ks_score_state_voice_update(state, index);
 
     return true;
 }
@@ -295,9 +641,6 @@ bool ks_score_channel_set_picthbend(ks_score_channel* channel, u8 msb, u8 lsb){
 bool ks_score_state_tempo_change(ks_score_state* state, const ks_synth_context* ctx, const ks_score_data* score, const u8* data){
     state->quarter_time = ks_calc_quarter_time(data);
     state->frames_per_event= ks_calc_frames_per_event(ctx, state->quarter_time, score->resolution);
-    for(unsigned i = 0; i< KS_NUM_CHANNELS; i++){
-        state->channels[i].output_log = realloc(state->channels[i].output_log, state->frames_per_event * 2 * sizeof(i32));
-    }
     return true;
 }
 
@@ -336,39 +679,374 @@ bool ks_score_state_control_change(ks_score_state* state, const ks_tone_list* to
     return true;
 }
 
+static void ks_score_state_render_voices(const ks_synth_context* ctx, ks_score_state* state, ks_synth_render_buffer* rb, const ks_score_voice_job* job, i32* log, u32 frame, u32* retired_voices){
+    const ks_score_channel* channel = &state->channels[job->channel];
+    ks_synth_note* notes[KS_SYNTH_MAX_LANES];
+
+    for(u32 n=0; n<job->num_notes; n++){
+        notes[n] = &state->notes[job->indices[n]].note;
+    }
+
+    if(job->mono){
+        ks_synth_render_voices_mono_add(ctx, rb, notes, job->num_notes, channel->volume_cache, channel->pitchbend, log, frame / 2);
+    } else {
+        ks_synth_render_voices_add(ctx, rb, notes, job->num_notes, channel->volume_cache, channel->pitchbend, log, frame);
+    }
+
+    for(u32 n=0; n<job->num_notes; n++){
+        if(ks_synth_note_is_silent(notes[n], channel->volume_cache, state->silence_threshold)){
+            notes[n]->envelopes[0].state = KS_ENVELOPE_OFF;
+            (*retired_voices) ++;
+        }
+        ks_score_state_voice_update(state, job->indices[n]);
+    }
+}
+
+// renders a job into the channel buses of the state
+static void ks_score_state_render_job(const ks_synth_context* ctx, ks_score_state* state, const ks_score_voice_job* job, u32 frame){
+    ks_score_channel* channel = &state->channels[job->channel];
+    i32* log = job->mono ? channel->mono_log : channel->output_log;
+    ks_score_state_render_voices(ctx, state, state->render_buffer, job, log, frame, &state->retired_voices);
+}
+
+#ifdef KS_HAVE_PTHREAD
+
+// renders a job into the private buses of a worker, they are cleared at first use in the tile
+static void ks_score_bus_render_job(const ks_synth_context* ctx, ks_score_state* state, ks_score_bus* bus, const ks_score_voice_job* job, u32 frame){
+    const u32 bit = ks_1(job->channel);
+    i32* log;
+    if(job->mono){
+        log = bus->mono_logs[job->channel];
+        if(!(bus->mono_used & bit)){
+            memset(log, 0, frame / 2 * sizeof(i32));
+            bus->mono_used |= bit;
+        }
+    } else {
+        log = bus->output_logs[job->channel];
+        if(!(bus->output_used & bit)){
+            memset(log, 0, frame * sizeof(i32));
+            bus->output_used |= bit;
+        }
+    }
+    ks_score_state_render_voices(ctx, state, bus->render_buffer, job, log, frame, &bus->retired_voices);
+}
+
+// adds private buses to channels in order of workers, sums of integers are same as the single threaded render
+static void ks_score_workers_reduce(ks_score_workers* pool, ks_score_state* state, u32 frame){
+    for(u32 w=0; w<pool->num_workers; w++){
+        ks_score_bus* bus = &pool->workers[w].bus;
+        for(u32 c=0; c<KS_NUM_CHANNELS; c++){
+            if(bus->output_used & ks_1(c)){
+                i32* out = state->channels[c].output_log;
+                const i32* in = bus->output_logs[c];
+                for(u32 i=0; i<frame; i++){
+                    out[i] += in[i];
+                }
+            }
+            if(bus->mono_used & ks_1(c)){
+                i32* out = state->channels[c].mono_log;
+                const i32* in = bus->mono_logs[c];
+                for(u32 i=0; i<frame/2; i++){
+                    out[i] += in[i];
+                }
+            }
+        }
+        state->retired_voices += bus->retired_voices;
+        bus->output_used = 0;
+        bus->mono_used = 0;
+        bus->retired_voices = 0;
+    }
+}
+
+static bool ks_score_workers_next_job(ks_score_workers* pool, u32* job){
+    pthread_mutex_lock(&pool->mutex);
+    *job = pool->next_job;
+    if(pool->next_job < pool->num_jobs){
+        pool->next_job ++;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return *job < pool->num_jobs;
+}
+
+static void* ks_score_worker_main(void* arg){
+    ks_score_worker* worker = arg;
+    ks_score_workers* pool = worker->pool;
+    u32 generation = 0;
+
+    pthread_mutex_lock(&pool->mutex);
+    for(;;){
+        while(!pool->quit && pool->generation == generation){
+            pthread_cond_wait(&pool->start, &pool->mutex);
+        }
+        if(pool->quit) break;
+        generation = pool->generation;
+        pthread_mutex_unlock(&pool->mutex);
+
+        u32 j;
+        while(ks_score_workers_next_job(pool, &j)){
+            ks_score_bus_render_job(pool->ctx, pool->state, &worker->bus, &pool->jobs[j], pool->frame);
+        }
+
+        pthread_mutex_lock(&pool->mutex);
+        pool->running --;
+        if(pool->running == 0){
+            pthread_cond_signal(&pool->finish);
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return NULL;
+}
+
+#endif
+
+// renders collected jobs of a tile, the caller's thread also takes jobs and renders them into channels directly
+static void ks_score_workers_run(ks_score_workers* pool, const ks_synth_context* ctx, ks_score_state* state, u32 frame){
+#ifdef KS_HAVE_PTHREAD
+    if(pool->num_jobs >= KS_SCORE_MIN_WORKER_JOBS){
+        pthread_mutex_lock(&pool->mutex);
+        pool->ctx = ctx;
+        pool->state = state;
+        pool->frame = frame;
+        pool->next_job = 0;
+        pool->running = pool->num_workers;
+        pool->generation ++;
+        pthread_cond_broadcast(&pool->start);
+        pthread_mutex_unlock(&pool->mutex);
+
+        u32 j;
+        while(ks_score_workers_next_job(pool, &j)){
+            ks_score_state_render_job(ctx, state, &pool->jobs[j], frame);
+        }
+
+        pthread_mutex_lock(&pool->mutex);
+        while(pool->running != 0){
+            pthread_cond_wait(&pool->finish, &pool->mutex);
+        }
+        pthread_mutex_unlock(&pool->mutex);
+
+        ks_score_workers_reduce(pool, state, frame);
+        pool->num_jobs = 0;
+        return;
+    }
+#endif
+    for(u32 j=0; j<pool->num_jobs; j++){
+        ks_score_state_render_job(ctx, state, &pool->jobs[j], frame);
+    }
+    pool->num_jobs = 0;
+}
+
+static void ks_score_workers_free(ks_score_workers* pool){
+#ifdef KS_HAVE_PTHREAD
+    pthread_mutex_lock(&pool->mutex);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for(u32 w=0; w<pool->num_workers; w++){
+        pthread_join(pool->workers[w].thread, NULL);
+    }
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->finish);
+#endif
+    for(u32 w=0; w<pool->num_workers; w++){
+        ks_synth_render_buffer_free(pool->workers[w].bus.render_buffer);
+        free(pool->workers[w].bus.output_logs[0]);
+    }
+    free(pool->workers);
+    free(pool->jobs);
+    free(pool);
+}
+
+bool ks_score_state_set_workers(ks_score_state* state, u32 num_workers){
+    if(state->workers != NULL){
+        ks_score_workers_free(state->workers);
+        state->workers = NULL;
+    }
+    if(num_workers <= 1){
+        return true;
+    }
+
+#ifdef KS_HAVE_PTHREAD
+    ks_score_workers* pool = calloc(1, sizeof(ks_score_workers));
+    pool->workers = calloc(num_workers - 1, sizeof(ks_score_worker));
+    pool->jobs = malloc(ks_1(state->polyphony_bits) * sizeof(ks_score_voice_job));
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->finish, NULL);
+
+    for(u32 w=0; w<num_workers - 1; w++){
+        ks_score_worker* worker = &pool->workers[w];
+        worker->pool = pool;
+        worker->bus.render_buffer = ks_synth_render_buffer_new(KS_SYNTH_TILE_FRAMES, KS_SYNTH_MAX_LANES);
+
+        i32* logs = malloc(KS_NUM_CHANNELS * KS_SYNTH_TILE_FRAMES * 3 * sizeof(i32));
+        for(u32 c=0; c<KS_NUM_CHANNELS; c++){
+            worker->bus.output_logs[c] = logs + c * KS_SYNTH_TILE_FRAMES * 2;
+            worker->bus.mono_logs[c] = logs + (KS_NUM_CHANNELS * 2 + c) * KS_SYNTH_TILE_FRAMES;
+        }
+
+        if(pthread_create(&worker->thread, NULL, ks_score_worker_main, worker) != 0){
+            ks_error("Failed to start worker %d of score", w);
+            ks_synth_render_buffer_free(worker->bus.render_buffer);
+            free(logs);
+            ks_score_workers_free(pool);
+            return false;
+        }
+        pool->num_workers ++;
+    }
+
+    state->workers = pool;
+    return true;
+#else
+    ks_warning("Workers of score are not supported in this build, voices are rendered on the caller's thread");
+    return false;
+#endif
+}
+
+// decides the output bus of notes, then renders them now or collects them for workers
+static void ks_score_state_dispatch_voices(const ks_synth_context* ctx, ks_score_state* state, const u32 indices[], u32 num_notes, u8 channel_number, u32 frame){
+    ks_score_channel* channel = &state->channels[channel_number];
+    ks_score_voice_job* job;
+    ks_score_voice_job local;
+
+    if(state->workers != NULL){
+        job = &state->workers->jobs[state->workers->num_jobs++];
+    } else {
+        job = &local;
+    }
+
+    for(u32 n=0; n<num_notes; n++){
+        job->indices[n] = indices[n];
+    }
+    job->num_notes = num_notes;
+    job->channel = channel_number;
+
+    // voices of a fixed panpot are summed in mono, one panpot per channel
+    const ks_synth* synth = state->notes[indices[0]].note.synth;
+    job->mono = !synth->lfo_panpot_enabled && (channel->mono_synth == NULL || channel->mono_synth->panpot == synth->panpot);
+    if(job->mono && channel->mono_synth == NULL){
+        memset(channel->mono_log, 0, frame / 2 * sizeof(i32));
+        channel->mono_synth = synth;
+    }
+
+    if(state->workers == NULL){
+        ks_score_state_render_job(ctx, state, job, frame);
+    }
+}
+
+// frames until the end of the tick which runs the next event
+static u32 ks_score_state_frames_to_event(const ks_score_data* score, const ks_score_state* state){
+    // ended score runs the end of track at every tick
+    if(state->passed_tick < 0){
+        return state->remaining_frame;
+    }
+    const u32 delta = score->data[state->current_event].delta;
+    const u32 ticks = (u32)state->passed_tick >= delta ? 0 : delta - state->passed_tick;
+    return state->remaining_frame + (u32)MIN((u64)ticks * state->frames_per_event, UINT32_MAX - state->remaining_frame);
+}
+
 void ks_score_data_render(const ks_score_data *score, const ks_synth_context* ctx, ks_score_state* state, const ks_tone_list*tones, i32* buf, u32 len){
     unsigned i=0;
     memset(buf, 0, sizeof(i32)*len);
     do{
-        u32 frame = MIN(len-i, state->remaining_frame*2);
-        i32* tmpbuf = malloc(sizeof(i32)*frame);
+        // voices are rendered tile by tile, ticks without events are rendered together
+        u32 frame = MIN(MIN(len-i, ks_score_state_frames_to_event(score, state)*2), ks_v(KS_SYNTH_TILE_FRAMES, 1));
 
         bool channel_enabled[KS_NUM_CHANNELS];
         memset(channel_enabled, false, sizeof(channel_enabled)); // all false
 
-        //render each notes to channels
-        for(u32 p=0; p<ks_1(state->polyphony_bits); p++){
-            if(!ks_score_note_is_enabled(&state->notes[p])) {
+        // notes of same synth in same channel are rendered together
+        u32 groups[KS_SCORE_VOICE_GROUPS][KS_SYNTH_MAX_LANES];
+        u32 group_lengths[KS_SCORE_VOICE_GROUPS] = { 0 };
+        u8 group_channels[KS_SCORE_VOICE_GROUPS];
+        u32 next_flush = 0;
+
+        // quieter notes over the budget are virtual, notes of muted channels are not counted
+        u32 budget_gain = 0, budget_ties = 0;
+        const bool over_budget = state->voice_budget != 0 && state->voices.num_actives > state->voice_budget &&
+                ks_score_state_find_budget(state, &budget_gain, &budget_ties);
+        state->virtual_voices = 0;
+
+        //render each notes to channels, and remove ended notes from the list
+        u32 num_actives = 0;
+        for(u32 a=0; a<state->voices.num_actives; a++){
+            const u32 p = state->voices.actives[a];
+            if(!ks_score_state_voice_is_enabled(state, p)) {
+                ks_score_state_voice_free(state, p);
+                continue;
+            }
+            state->voices.actives[num_actives++] = p;
+
+            const u8 channel_number = state->voices.infos[p].channel;
+            ks_score_channel* channel = &state->channels[channel_number];
+
+            bool audible = !(state->muted_channels & ks_1(channel_number));
+            if(audible && over_budget && !ks_score_state_voice_is_fresh(state, p)){
+                const u32 gain = ks_score_state_voice_gain(state, p);
+                if(gain == budget_gain && budget_ties != 0){
+                    budget_ties --;
+                } else {
+                    audible = gain > budget_gain;
+                }
+            }
+            // virtual notes keep their state without output, they can be audible again at any block
+            if(!audible){
+                ks_synth_note* note = &state->notes[p].note;
+                ks_synth_note_skip(ctx, note, channel->pitchbend, frame / 2);
+                if(ks_synth_note_is_silent(note, channel->volume_cache, state->silence_threshold)){
+                    note->envelopes[0].state = KS_ENVELOPE_OFF;
+                    state->retired_voices ++;
+                }
+                ks_score_state_voice_update(state, p);
+                state->virtual_voices ++;
                 continue;
             }
 
-            ks_score_channel* channel = &state->channels[state->notes[p].info.channel];
-
-            if(channel_enabled[state->notes[p].info.channel] == false){
+            if(channel_enabled[channel_number] == false){
                 memset(channel->output_log, 0, frame* sizeof(i32));
-                channel_enabled[state->notes[p].info.channel]= true;
+                channel_enabled[channel_number]= true;
             }
 
             // when note on, already checked,
             //if(channel->bank == NULL) continue;
             //if(channel->bank->programs[channel->program_number] == NULL) continue;
-            ks_synth_note* note = &state->notes[p].note;
-            ks_synth_render(ctx, note, channel->volume_cache, channel->pitchbend, tmpbuf, frame);
+            const ks_synth_note* note = &state->notes[p].note;
 
-            for(u32 b =0; b< frame; b+=2){
-                channel->output_log[b] += tmpbuf[b];
-                channel->output_log[b + 1] += tmpbuf[b+1];
+            u32 g = 0;
+            while(g < KS_SCORE_VOICE_GROUPS && group_lengths[g] != 0 &&
+                  (group_channels[g] != channel_number || !ks_synth_note_can_share_lanes(&state->notes[groups[g][0]].note, note))){
+                g++;
+            }
+            if(g == KS_SCORE_VOICE_GROUPS){
+                g = next_flush;
+                next_flush = ks_mask(next_flush + 1, KS_SCORE_VOICE_GROUP_BITS);
+                ks_score_state_dispatch_voices(ctx, state, groups[g], group_lengths[g], group_channels[g], frame);
+                group_lengths[g] = 0;
             }
+
+            groups[g][group_lengths[g]++] = p;
+            group_channels[g] = channel_number;
+
+            if(group_lengths[g] == KS_SYNTH_MAX_LANES){
+                ks_score_state_dispatch_voices(ctx, state, groups[g], group_lengths[g], group_channels[g], frame);
+                group_lengths[g] = 0;
+            }
+        }
+        state->voices.num_actives = num_actives;
+        state->voices.rendered_serial = state->voices.next_serial;
+        state->peak_voices = MAX(state->peak_voices, num_actives - state->virtual_voices);
+        state->peak_virtual_voices = MAX(state->peak_virtual_voices, state->virtual_voices);
+
+        for(u32 g=0; g<KS_SCORE_VOICE_GROUPS; g++){
+            if(group_lengths[g] != 0){
+                ks_score_state_dispatch_voices(ctx, state, groups[g], group_lengths[g], group_channels[g], frame);
+            }
+        }
+
+        if(state->workers != NULL){
+            ks_score_workers_run(state->workers, ctx, state, frame);
         }
 
         // mix to buffer
@@ -376,9 +1054,24 @@ void ks_score_data_render(const ks_score_data *score, const ks_synth_context* ct
             if(!channel_enabled[c]) continue;
             ks_score_channel* channel = &state->channels[c];
 
-            for(u32 b =0; b< frame; b+=2){
-                buf[(i + b)] += channel->output_log[b] = ks_apply_panpot(channel->output_log[b], channel->panpot_left);
-                buf[(i + b) + 1] +=channel->output_log[b+1] =  ks_apply_panpot(channel->output_log[b+1], channel->panpot_right);
+            if(channel->mono_synth != NULL){
+                // synth panpot and channel panpot at once, with the half gain of stereo voices
+                i16 synth_left, synth_right;
+                ks_synth_panpot_gains(ctx, channel->mono_synth, &synth_left, &synth_right);
+                const i16 mono_left = ((i32)synth_left * channel->panpot_left) >> (KS_OUTPUT_BITS + 1);
+                const i16 mono_right = ((i32)synth_right * channel->panpot_right) >> (KS_OUTPUT_BITS + 1);
+
+                for(u32 b =0; b< frame; b+=2){
+                    const i32 mono = channel->mono_log[b >> 1];
+                    buf[(i + b)] += channel->output_log[b] = ks_apply_panpot(channel->output_log[b], channel->panpot_left) + ks_apply_panpot(mono, mono_left);
+                    buf[(i + b) + 1] +=channel->output_log[b+1] =  ks_apply_panpot(channel->output_log[b+1], channel->panpot_right) + ks_apply_panpot(mono, mono_right);
+                }
+                channel->mono_synth = NULL;
+            } else {
+                for(u32 b =0; b< frame; b+=2){
+                    buf[(i + b)] += channel->output_log[b] = ks_apply_panpot(channel->output_log[b], channel->panpot_left);
+                    buf[(i + b) + 1] +=channel->output_log[b+1] =  ks_apply_panpot(channel->output_log[b+1], channel->panpot_right);
+                }
             }
         }
 
@@ -391,11 +1084,10 @@ void ks_score_data_render(const ks_score_data *score, const ks_synth_context* ct
             }
         }
 
-        free(tmpbuf);
-
-        state->remaining_frame -= frame >> 1;
-
-        if(state->remaining_frame == 0){
+        // the block ends at or before the tick of the next event, so only the last tick can run events
+        u32 advance = frame >> 1;
+        while(advance >= state->remaining_frame){
+            advance -= state->remaining_frame;
             if((u32)state->passed_tick >= score->data[state->current_event].delta){
                 state->passed_tick -= score->data[state->current_event].delta;
                 if(ks_score_data_event_run(score, ctx, state, tones)){
@@ -407,6 +1099,7 @@ void ks_score_data_render(const ks_score_data *score, const ks_synth_context* ct
 
             state->remaining_frame = state->frames_per_event;
         }
+        state->remaining_frame -= advance;
 
         i+= frame;
     }while(i<len);
@@ -489,13 +1182,21 @@ void ks_score_state_set_default(ks_score_state* state, const ks_tone_list *tones
     state->current_event = 0;
     state->passed_tick = 0;
     state->current_tick = 0;
+    state->retired_voices = 0;
+    state->stolen_voices = 0;
+    state->peak_voices = 0;
+    state->peak_virtual_voices = 0;
     for(unsigned i=0; i<ks_1(state->polyphony_bits); i++) {
         memset(&state->notes[i], 0 , sizeof(ks_score_note));
     }
+    ks_score_state_voices_reset(state);
     for(unsigned i =0; i<KS_NUM_CHANNELS; i++){
         if( state->channels[i].output_log != NULL) {
             free( state->channels[i].output_log );
         }
+        if( state->channels[i].mono_log != NULL) {
+            free( state->channels[i].mono_log );
+        }
 
         memset(&state->channels[i], 0 , sizeof(ks_score_channel));
         ks_score_channel_set_panpot(&state->channels[i], ctx, 64);
@@ -505,7 +1206,9 @@ void ks_score_state_set_default(ks_score_state* state, const ks_tone_list *tones
         state->channels[i].expression= 127;
         set_channel_volume_cache(&state->channels[i]);
 
-        state->channels[i].output_log = malloc(state->frames_per_event * 2 * sizeof(i32));
+        // blocks are up to a tile, whatever the tempo is
+        state->channels[i].output_log = malloc(KS_SYNTH_TILE_FRAMES * 2 * sizeof(i32));
+        state->channels[i].mono_log = malloc(KS_SYNTH_TILE_FRAMES * sizeof(i32));
     }
 }
 
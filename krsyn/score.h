@@ -18,9 +18,21 @@ extern "C" {
 
 #define     KS_DEFAULT_QUARTER_TIME     ks_1(KS_QUARTER_TIME_BITS - 1)
 
+// number of groups of notes waiting to be rendered together
+#define KS_SCORE_VOICE_GROUP_BITS       2u
+#define KS_SCORE_VOICE_GROUPS           ks_1(KS_SCORE_VOICE_GROUP_BITS)
+// suggested silence_threshold, not set by default. A full scale wave under it is under the least bit,
+// but resonant filters can peak over full scale before the envelope, so tails of high Q notes may be cut.
+#define KS_SCORE_DEFAULT_SILENCE_THRESHOLD  ks_1(KS_ENVELOPE_BITS - KS_OUTPUT_BITS - 2)
+// release time of notes stopped by choke groups
+#define KS_SCORE_CHOKE_MSEC             8u
+// tiles with less groups of voices than this are rendered on the caller's thread, even if workers are set
+#define KS_SCORE_MIN_WORKER_JOBS        2u
+
 typedef         struct ks_tone_list         ks_tone_list;
 typedef         struct ks_tone_list_bank    ks_tone_list_bank;
 typedef         struct ks_midi_file         ks_midi_file;
+typedef         struct ks_score_workers     ks_score_workers;
 
 /**
   * @struct ks_score_channel
@@ -40,6 +52,8 @@ typedef struct ks_score_channel{
     u16                 volume_cache;
 
     i32                *output_log;
+    i32                *mono_log;               // voices without panpot LFO, panned at mixing
+    const ks_synth     *mono_synth;             // its panpot is applied to mono_log, NULL : mono_log is empty
 }ks_score_channel;
 
 /**
@@ -57,9 +71,52 @@ typedef struct ks_score_note_info{
 */
 typedef struct ks_score_note{
     ks_synth_note           note;
-    ks_score_note_info      info;
 }ks_score_note;
 
+/**
+  * @enum ks_score_steal_policy
+  * @brief Which note is stopped for a new note, when the pool or the voice limit of a channel is full.
+*/
+typedef enum ks_score_steal_policy{
+    KS_SCORE_STEAL_NONE,                        // new notes are dropped
+    KS_SCORE_STEAL_OLDEST_RELEASED,             // oldest released note, or oldest note if all notes are on
+    KS_SCORE_STEAL_QUIETEST,                    // note of the lowest envelope gain with channel volume
+    KS_SCORE_STEAL_LOWEST_PRIORITY,             // note of the channel of the lowest priority, then as KS_SCORE_STEAL_OLDEST_RELEASED
+    KS_NUM_SCORE_STEAL_POLICIES,
+}ks_score_steal_policy;
+
+/**
+  * @enum ks_score_retrigger
+  * @brief Channels whose note on of a sounding note reuses its voice, instead of releasing it and taking a new voice.
+*/
+typedef enum ks_score_retrigger{
+    KS_SCORE_RETRIGGER_NONE,
+    KS_SCORE_RETRIGGER_PERCUSSION,              // channels of percussion banks
+    KS_SCORE_RETRIGGER_ALL,
+    KS_NUM_SCORE_RETRIGGERS,
+}ks_score_retrigger;
+
+/**
+  * @struct ks_score_voice_pool
+  * @brief States of notes scanned at every event, in structure of arrays, indices are same as ks_score_state::notes.
+  * Only the state read to find and schedule notes is here. Per sample state, phases, envelope levels and filter history,
+  * still lives in ks_synth_note at the front of each ks_score_state::notes, not in arrays of the pool.
+*/
+typedef struct ks_score_voice_pool{
+    u8                      *states;            // envelopes[0].state of notes
+    ks_score_note_info      *infos;
+    u32                     *actives;           // indices of enabled notes in ascending order, ended notes are removed at next render
+    u32                     num_actives;
+    u32                     *frees;             // stack of indices of notes which are not in actives
+    u32                     num_frees;
+    u32                     key_voices      [KS_NUM_CHANNELS * KS_NUM_NOTES];  // [channel][note number], the note keyed on last, may be ended
+    u32                     *serials;           // order of note on, to find old notes
+    u32                     next_serial;
+    u32                     rendered_serial;    // next_serial at the last block, later notes have not been rendered
+    u16                     channel_voices  [KS_NUM_CHANNELS];  // number of notes in actives
+    u32                     *gains;             // scratch to find gain of the limit of voice_budget
+}ks_score_voice_pool;
+
 
 typedef enum ks_effect_type{
     KS_EFFECT_VOLUME_ANALIZER,
@@ -109,7 +166,27 @@ typedef struct ks_score_state{
     i32                 passed_tick;
     u32                 current_tick;
 
+    u32                 silence_threshold;      // gain in KS_ENVELOPE_BITS, released notes under it are retired, 0 : disabled
+    u32                 retired_voices;         // number of notes retired by silence_threshold
+    u32                 stolen_voices;          // number of notes stopped for new notes
+
+    u8                  steal_policy;           // ks_score_steal_policy
+    u8                  channel_priorities  [KS_NUM_CHANNELS];  // notes of lower priority channels are stolen first
+    u16                 channel_voice_limits[KS_NUM_CHANNELS];  // maximum number of notes of each channel, 0 : no limit
+
+    u16                 muted_channels;         // bits of channels whose notes are virtual
+    u16                 voice_budget;           // maximum number of audible notes, quieter notes are virtual, 0 : no limit
+    u32                 virtual_voices;         // number of virtual notes in the last block, they advance without output
+    u32                 peak_voices;            // maximum number of audible notes in a block
+    u32                 peak_virtual_voices;    // maximum number of virtual notes in a block
+
+    u8                  retrigger;              // ks_score_retrigger
+    u8                  choke_groups    [KS_NUM_NOTES];     // group of each note of percussion banks, a note on stops other notes of its group, 0 : none
+
     ks_effect_list      effects;
+    ks_synth_render_buffer  *render_buffer;
+    ks_score_voice_pool     voices;
+    ks_score_workers        *workers;           // NULL : voices are rendered on the caller's thread
 
     ks_score_channel    channels        [KS_NUM_CHANNELS];
     ks_score_note       notes           [];
@@ -151,6 +228,12 @@ float               ks_score_data_calc_score_length (ks_score_data* data, const
 
 ks_score_state*     ks_score_state_new              (u32 polyphony_bits);
 void                ks_score_state_free             (ks_score_state* state);
+// num_workers includes the caller's thread, 0 or 1 stops workers. Output is same as without workers.
+// returns false if threads are not supported or failed to start, then voices are rendered on the caller's thread.
+bool                ks_score_state_set_workers      (ks_score_state* state, u32 num_workers);
+// retriggers notes of percussion banks and sets exclusive classes of GS drum sets to choke_groups.
+// they are not set by default, so that existing scores sound as before
+void                ks_score_state_set_gs_percussion(ks_score_state* state);
 
 bool                ks_score_state_note_on          (ks_score_state* state, const ks_synth_context* ctx, u8 channel_number, u8 note_number, u8 velocity);
 bool                ks_score_state_note_off         (ks_score_state* state, u8 channel_number,  u8 note_number);
@@ -175,9 +258,9 @@ void                ks_score_events_free            (const ks_score_event *event
 
 bool                ks_score_note_is_enabled        (const ks_score_note* note);
 bool                ks_score_note_is_on             (const ks_score_note* note);
+bool                ks_score_state_voice_is_enabled (const ks_score_state* state, u32 index);
 
 bool                ks_score_note_info_equals       (ks_score_note_info i1, ks_score_note_info i2);
-i16                 ks_score_note_info_hash         (ks_score_note_info id);
 ks_score_note_info  ks_score_note_info_of           (u8 note_number, u8 channel);
 
 void                ks_score_state_add_volume_analizer      (ks_score_state* state, const ks_synth_context* ctx, u32 duration);
@@ -1,4 +1,5 @@
 #include "synth.h"
+#include "synth_simd.h"
 
 #include <ksio/serial/binary.h>
 #include <memory.h>
@@ -10,6 +11,16 @@
 #define M_PI  3.14159265358979323846
 #endif
 
+#define KS_NOISE_SEED   2463534242u
+
+// xorshift32, so that noise does not depend on global state of rand()
+KS_FORCEINLINE static u32 ks_noise_next(u32 x){
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
 ks_io_begin_custom_func(ks_lfo_data)
     ks_bit_val(op_enabled);
     ks_bit_val(filter_enabled);
@@ -71,6 +82,50 @@ ks_io_begin_custom_func(ks_synth_data)
 ks_io_end_custom_func(ks_synth_data)
 
 
+static ks_biquad_coefs ks_biquad_coefs_calc(i32 sin_omega0, i32 cos_omega0, u8 type, u32 filter_q){
+    const i32 alpha = ks_v((i64)sin_omega0, KS_FILTER_Q_BITS) / filter_q;
+
+    i32 a0, a1, a2, b0, b1, b2;
+
+    switch (type) {
+    default:
+    case KS_LOW_PASS_FILTER:
+        a0 = ks_1(KS_OUTPUT_BITS) + alpha;
+        a1 = (-cos_omega0) << 1;
+        a2 = ks_1(KS_OUTPUT_BITS) - alpha;
+        b1 = ks_1(KS_OUTPUT_BITS) - cos_omega0;
+        b0 = b2 = b1 >> 1;
+        break;
+    case KS_HIGH_PASS_FILTER:
+        a0 = ks_1(KS_OUTPUT_BITS) + alpha;
+        a1 = (-cos_omega0) << 1;
+        a2 = ks_1(KS_OUTPUT_BITS) - alpha;
+        b1 = ks_1(KS_OUTPUT_BITS) + cos_omega0;
+        b0 = b2 = b1 >> 1;
+        b1 = -b1;
+        break;
+    case KS_BAND_PASS_FILTER:
+        a0 = ks_1 (KS_OUTPUT_BITS)+ alpha;
+        a1 = (-cos_omega0) << 1;
+        a2 = ks_1(KS_OUTPUT_BITS) - alpha;
+        b0 = sin_omega0 >> 1;
+        b1 = 0;
+        b2 = -b0;
+        break;
+    }
+
+    ks_biquad_coefs ret;
+    i64 a0inv = ks_v(1ll, KS_OUTPUT_BITS*2 + KS_OUTPUT_BITS) / a0;
+    ret.a1a0 = ((i64)a1 * a0inv) >> (KS_OUTPUT_BITS*2);
+    ret.a2a0 = ((i64)a2 * a0inv) >> (KS_OUTPUT_BITS*2);
+
+    ret.b0a0 = ((i64)b0 * a0inv) >> (KS_OUTPUT_BITS*2);
+    ret.b1a0 = ((i64)b1 * a0inv) >> (KS_OUTPUT_BITS*2);
+    ret.b2a0 = ((i64)b2 * a0inv) >> (KS_OUTPUT_BITS*2);
+
+    return ret;
+}
+
 ks_synth_context* ks_synth_context_new(u32 sampling_rate){
     ks_synth_context *ret = calloc(1, sizeof(ks_synth_context));
     ret->sampling_rate = sampling_rate;
@@ -82,10 +137,10 @@ ks_synth_context* ks_synth_context_new(u32 sampling_rate){
     }
 
     for(unsigned i=0; i< KS_NUM_WAVES; i++){
-        ret->wave_tables[i] = malloc(sizeof(i16)* ks_1(KS_TABLE_BITS));
+        ret->wave_tables[i] = malloc(sizeof(i16)* KS_WAVE_TABLE_LENGTH);
     }
 
-    srand(0);
+    u32 noise = KS_NOISE_SEED;
     for(unsigned i=0; i< ks_1(KS_TABLE_BITS); i++){
         ret->wave_tables[KS_WAVE_SIN][i] = sin(2* M_PI * i / ks_1(KS_TABLE_BITS)) * (ks_1(KS_OUTPUT_BITS)-1);
         int p = ks_mask(i + (ks_1(KS_TABLE_BITS-2)), KS_TABLE_BITS);
@@ -100,10 +155,41 @@ ks_synth_context* ks_synth_context_new(u32 sampling_rate){
         ret->wave_tables[KS_WAVE_SAW_UP][i] = -ret->wave_tables[KS_WAVE_SAW_DOWN][i];
 
         ret->wave_tables[KS_WAVE_SQUARE][i] = i < ks_1(KS_TABLE_BITS-1) ? (ks_1(KS_OUTPUT_BITS)-1): -(ks_1(KS_OUTPUT_BITS)-1);
-        ret->wave_tables[KS_WAVE_NOISE][i] = rand();
+        noise = ks_noise_next(noise);
+        ret->wave_tables[KS_WAVE_NOISE][i] = noise >> 16;
 
         ret->powerof2[i] = pow(2, i*4/(float)ks_1(KS_TABLE_BITS)) * ks_1(KS_POWER_OF_2_BITS);
     }
+    // filter amounts are clamped to ks_1(KS_TABLE_BITS), it is included
+    ret->powerof2[ks_1(KS_TABLE_BITS)] = ks_v(16, KS_POWER_OF_2_BITS);
+
+    for(unsigned i=0; i< KS_NUM_WAVES; i++){
+        ret->wave_tables[i][ks_1(KS_TABLE_BITS)] = ret->wave_tables[i][0];
+    }
+
+    // coefficients depend only on sin table index of omega0 for each filter type and q
+    ret->filter_coefs = malloc(sizeof(ks_biquad_coefs) * KS_NUM_FILTER_TYPES * KS_FILTER_NUM_Q * KS_FILTER_NUM_OMEGAS);
+    ks_biquad_coefs* coefs = ret->filter_coefs;
+    for(unsigned t=0; t< KS_NUM_FILTER_TYPES; t++){
+        for(unsigned q=0; q< KS_FILTER_NUM_Q; q++){
+            for(unsigned i=0; i< KS_FILTER_NUM_OMEGAS; i++){
+                const i32 sin_omega0 = ret->wave_tables[KS_WAVE_SIN][i];
+                const i32 cos_omega0 = ret->wave_tables[KS_WAVE_SIN][i + ks_1(KS_TABLE_BITS-2)];
+                *coefs++ = ks_biquad_coefs_calc(sin_omega0, cos_omega0, t, calc_filter_q(q));
+            }
+        }
+    }
+
+    // equal power gains of panpot LFO depend only on sin table index of pan, see ks_calc_panpot
+    for(unsigned i=0; i< ks_1(KS_TABLE_BITS); i++){
+        const u32 fac = 92682; // sqrt(2)<<16
+        i16 left, right;
+        ks_calc_panpot(ret, &left, &right, i << KS_PANPOT_LFO_GAINS_SHIFT);
+        ret->panpot_lfo_gains[i][0] = ((i32)left * fac) >> 16;
+        ret->panpot_lfo_gains[i][1] = ((i32)right * fac) >> 16;
+    }
+
+    ret->simd = ks_simd_detect();
 
     //ret->num_waves = KS_NUM_WAVES;
 
@@ -116,6 +202,7 @@ void ks_synth_context_free(ks_synth_context * ctx){
     for(unsigned i=0; i< KS_MAX_WAVES; i++){
         if(ctx->wave_tables[i] != NULL) free(ctx->wave_tables[i]);
     }
+    free(ctx->filter_coefs);
 
     free(ctx);
 }
@@ -262,6 +349,13 @@ KS_INLINE i32 ks_apply_panpot(i32 in, i16 pan){
     return out;
 }
 
+void ks_synth_panpot_gains(const ks_synth_context *ctx, const ks_synth* synth, i16* left, i16* right){
+    ks_calc_panpot(ctx, left, right, synth->panpot << (KS_PANPOT_BITS - 7));
+}
+
+static void ks_synth_render_plan_set(ks_synth_render_plan* plan, const ks_synth* synth, const ks_synth_context* ctx);
+static void ks_synth_keys_set(ks_synth* synth, const ks_synth_context* ctx);
+
 void ks_synth_set(ks_synth* synth, const ks_synth_context* ctx, const ks_synth_data* data)
 {
     synth->enabled = true;
@@ -336,6 +430,11 @@ void ks_synth_set(ks_synth* synth, const ks_synth_context* ctx, const ks_synth_d
     synth->filter_type = data->filter_type;
     synth->filter_key_sens = calc_filter_key_sens(data->filter_key_sens);
     synth->filter_q = calc_filter_q(data->filter_q);
+    // other filter types are not applied
+    synth->filter_coefs = NULL;
+    if(data->filter_type < KS_NUM_FILTER_TYPES){
+        synth->filter_coefs = ctx->filter_coefs + (data->filter_type * KS_FILTER_NUM_Q + data->filter_q) * KS_FILTER_NUM_OMEGAS;
+    }
 
     synth->lfo_filter_enabled = 0;
     for(unsigned i=0; i< KS_NUM_LFOS; i++){
@@ -346,6 +445,18 @@ void ks_synth_set(ks_synth* synth, const ks_synth_context* ctx, const ks_synth_d
         }
     }
 
+    ks_synth_keys_set(synth, ctx);
+
+    // cutoff is the lowest at note number 0, and velocity scales envelope linearly
+    synth->filter_bypass = false;
+    if(synth->filter_type == KS_LOW_PASS_FILTER && synth->lfo_filter_enabled == 0){
+        ks_synth_note note;
+        ks_synth_note_on(&note, synth, ctx, 0, 0);
+        const bool bypass_min_velocity = note.filter_bypass;
+        ks_synth_note_on(&note, synth, ctx, 0, 127);
+        synth->filter_bypass = bypass_min_velocity && note.filter_bypass;
+    }
+
     synth->lfo_panpot_enabled = 0;
     for(unsigned i=0; i< KS_NUM_LFOS; i++){
         if(data->lfos[i].level == 0) continue;
@@ -356,6 +467,7 @@ void ks_synth_set(ks_synth* synth, const ks_synth_context* ctx, const ks_synth_d
     }
 
     synth->panpot = calc_panpot(data->panpot);
+    ks_synth_render_plan_set(&synth->plan, synth, ctx);
 
 }
 
@@ -391,6 +503,61 @@ KS_INLINE static u32 phase_delta(const ks_synth_context* ctx, u8 notenum, u32 co
     return (u32)delta;
 }
 
+static void ks_synth_keys_set(ks_synth* synth, const ks_synth_context* ctx){
+    for(u32 notenum=0; notenum<KS_NUM_NOTES; notenum++){
+        ks_synth_key* key = &synth->keys[notenum];
+
+        for(unsigned i=0; i< KS_NUM_OPERATORS; i++){
+            if(synth->operators[i].fixed_frequency){
+                key->phase_deltas[i] = phase_delta_fix_freq(ctx, synth->operators[i].phase_coarse, synth->operators[i].semitone, synth->operators[i].phase_fine);
+            } else {
+                key->phase_deltas[i] = phase_delta(ctx, notenum, synth->operators[i].phase_coarse, synth->operators[i].semitone, synth->operators[i].phase_fine);
+            }
+        }
+
+        for(unsigned i=0; i<KS_NUM_ENVELOPES; i++){
+            const u32 exp = ((u64)notenum * synth->envelopes[i].ratescale) >> KS_RATESCALE_INV_BITS;
+            const u32 val = ks_mask((ks_v((u64)notenum, KS_TABLE_BITS-2)  * synth->envelopes[i].ratescale) >> KS_RATESCALE_INV_BITS, KS_TABLE_BITS-2);
+            const i64 exp_val = (ctx->powerof2[ks_1(KS_TABLE_BITS-2) - val])  >> exp; // val^ -exp
+            //rate scale
+            const i64 ratescales = exp_val >> 1; // if val == 0 then base = 2
+
+            for(u32 j=0; j < KS_ENVELOPE_NUM_POINTS; j++){
+                u64 frame = (synth->envelopes[i].samples[j]);
+                frame *= ratescales;
+                frame >>= KS_RATESCALE_BITS;
+                key->samples[i][j] = MAX((u32)frame >> KS_UPDATE_PER_FRAMES_BITS, 1u);
+                key->deltas[i][j] = ks_1(KS_ENVELOPE_BITS) / (i32)key->samples[i][j];
+            }
+        }
+
+        const u32 key_sens = synth->filter_key_sens;
+        const u32 exp = ((u64)notenum * key_sens) >> KS_KEYSENS_INV_BITS;
+        const u32 val = ks_mask((ks_v((u64)notenum, KS_TABLE_BITS-2) * key_sens) >> KS_KEYSENS_INV_BITS, KS_TABLE_BITS-2);
+        const i64 exp_val = ((u64)ctx->powerof2[val]) << exp;
+        key->filter_cutoff = (exp_val * synth->filter_cutoff) >> (KS_POWER_OF_2_BITS+4);
+    }
+}
+
+// true if omega0 of low pass filter is clamped to nyquist frequency for the whole note
+static bool ks_synth_note_filter_is_transparent(const ks_synth_context* ctx, const ks_synth_note* note){
+    const ks_synth* synth = note->synth;
+    if(synth->filter_type != KS_LOW_PASS_FILTER || synth->lfo_filter_enabled != 0) return false;
+
+    // filter envelope starts from 0, but the filter sees points[0] first if the first segment takes only 1 update
+    i32 min_amp = note->envelope_setups[1].samples[0] > 1 ? 0 : INT32_MAX;
+    for(unsigned i=0; i<KS_ENVELOPE_NUM_POINTS; i++){
+        min_amp = MIN(min_amp, note->envelope_setups[1].points[i]);
+    }
+
+    i32 envelope_amp = (note->envelopes[1].level - min_amp) >> (KS_ENVELOPE_BITS - KS_TABLE_BITS);
+    envelope_amp = synth->filter_envelope_base - envelope_amp;
+    envelope_amp = MAX(MIN(ks_1(KS_TABLE_BITS), envelope_amp), 0);
+
+    const i64 omega0 = ((i64)note->filter_cutoff * ctx->powerof2[envelope_amp]) >> (KS_POWER_OF_2_BITS+2);
+    return omega0 >= ks_1(KS_PHASE_MAX_BITS-1);
+}
+
 void ks_synth_note_on(ks_synth_note* note, const ks_synth *synth, const ks_synth_context *ctx, u8 notenum, u8 vel)
 {
     if(! synth->enabled) return;
@@ -411,29 +578,15 @@ void ks_synth_note_on(ks_synth_note* note, const ks_synth *synth, const ks_synth
     }
 
 
-    for(unsigned i=0; i< KS_NUM_OPERATORS; i++)
-    {
-        if(synth->operators[i].fixed_frequency)
-        {
-            note->operators[i].phase_delta = phase_delta_fix_freq(ctx, synth->operators[i].phase_coarse, synth->operators[i].semitone, synth->operators[i].phase_fine);
-        }
-        else
-        {
-            note->operators[i].phase_delta = phase_delta(ctx, notenum, synth->operators[i].phase_coarse, synth->operators[i].semitone, synth->operators[i].phase_fine);
-        }
+    const ks_synth_key* key = &synth->keys[notenum];
 
+    for(unsigned i=0; i< KS_NUM_OPERATORS; i++){
+        note->operators[i].phase_delta = key->phase_deltas[i];
     }
 
     for(unsigned i=0; i<KS_NUM_ENVELOPES; i++){
         note->envelopes[i].update_clock =0;
 
-        i64 ratescales;
-        const u32 exp = ((u64)notenum * synth->envelopes[i].ratescale) >> KS_RATESCALE_INV_BITS;
-        const u32 val = ks_mask((ks_v((u64)notenum, KS_TABLE_BITS-2)  * synth->envelopes[i].ratescale) >> KS_RATESCALE_INV_BITS, KS_TABLE_BITS-2);
-        const i64 exp_val = (ctx->powerof2[ks_1(KS_TABLE_BITS-2) - val])  >> exp; // val^ -exp
-        //rate scale
-        ratescales = exp_val >> 1; // if val == 0 then base = 2
-
         i64 target;
         i32 velocity;
 
@@ -456,66 +609,78 @@ void ks_synth_note_on(ks_synth_note* note, const ks_synth *synth, const ks_synth
             target *= velocity;
             target >>= KS_VELOCITY_SENS_BITS;
 
-            note->envelopes[i].points[j] = (i32)target;
-
-            u64 frame = (synth->envelopes[i].samples[j]);
-            frame *= ratescales;
-            frame >>= KS_RATESCALE_BITS;
-            note->envelopes[i].samples[j] = MAX((u32)frame >> KS_UPDATE_PER_FRAMES_BITS, 1u);
+            note->envelope_setups[i].points[j] = (i32)target;
+            note->envelope_setups[i].samples[j] = key->samples[i][j];
+            note->envelope_setups[i].deltas[j] = key->deltas[i][j];
         }
 
-        note->envelopes[i].deltas[0] = ks_1(KS_ENVELOPE_BITS);
-        note->envelopes[i].deltas[0] /= (i32)note->envelopes[i].samples[0];
-        note->envelopes[i].diffs[0] = note->envelopes[i].points[0];
+        note->envelope_setups[i].diffs[0] = note->envelope_setups[i].points[0];
         for(u32 j=1; j < KS_ENVELOPE_NUM_POINTS; j++)
         {
-            i32 sub = note->envelopes[i].points[j] - note->envelopes[i].points[j-1];
-            note->envelopes[i].diffs[j] = sub;
-            note->envelopes[i].deltas[j] =  ks_1(KS_ENVELOPE_BITS);
-            note->envelopes[i].deltas[j] /=  ((i32)note->envelopes[i].samples[j]);
+            note->envelope_setups[i].diffs[j] = note->envelope_setups[i].points[j] - note->envelope_setups[i].points[j-1];
         }
 
         //envelope state init
         note->envelopes[i].now_amp = 0;
-        note->envelopes[i].now_point_amp= note->envelopes[i].points[0];
-        note->envelopes[i].now_time = note->envelopes[i].samples[0];
-        note->envelopes[i].now_delta = note->envelopes[i].deltas[0];
-        note->envelopes[i].now_diff = note->envelopes[i].diffs[0];
+        note->envelopes[i].now_point_amp= note->envelope_setups[i].points[0];
+        note->envelopes[i].now_time = note->envelope_setups[i].samples[0];
+        note->envelopes[i].now_delta = note->envelope_setups[i].deltas[0];
+        note->envelopes[i].now_diff = note->envelope_setups[i].diffs[0];
         note->envelopes[i].now_remain= ks_1(KS_ENVELOPE_BITS);
         note->envelopes[i].now_point = 0;
         note->envelopes[i].state = KS_ENVELOPE_ON;
     }
 
-    note->noise_table_offset = 0;
+    note->noise_table_offset = KS_NOISE_SEED;
     note->filter_seek = 0;
-
-    const u32 key_sens = synth->filter_key_sens;
-    const u32 exp = ((u64)notenum * key_sens) >> KS_KEYSENS_INV_BITS;
-    const u32 val = ks_mask((ks_v((u64)notenum, KS_TABLE_BITS-2) * key_sens) >> KS_KEYSENS_INV_BITS, KS_TABLE_BITS-2);
-    const i64 exp_val = ((u64)ctx->powerof2[val]) << exp;
-    const i64 cutoff = (exp_val * synth->filter_cutoff) >> (KS_POWER_OF_2_BITS+4);
-
-    note->filter_cutoff = cutoff;
-
+    note->filter_cutoff = key->filter_cutoff;
+    note->filter_bypass = synth->filter_bypass || ks_synth_note_filter_is_transparent(ctx, note);
 }
 
 void ks_synth_note_off (ks_synth_note* note)
 {
     for(unsigned i=0; i< KS_NUM_ENVELOPES; i++)
     {
-        note->envelopes[i].now_time = note->envelopes[i].samples[KS_ENVELOPE_RELEASE_INDEX];
+        note->envelopes[i].now_time = note->envelope_setups[i].samples[KS_ENVELOPE_RELEASE_INDEX];
         note->envelopes[i].now_point = KS_ENVELOPE_RELEASE_INDEX;
         note->envelopes[i].state = KS_ENVELOPE_RELEASED;
 
         note->envelopes[i].now_remain= ks_1(KS_ENVELOPE_BITS);
-        i32 sub = note->envelopes[i].points[KS_ENVELOPE_RELEASE_INDEX] - note->envelopes[i].now_amp;
+        i32 sub = note->envelope_setups[i].points[KS_ENVELOPE_RELEASE_INDEX] - note->envelopes[i].now_amp;
         note->envelopes[i].now_diff =  sub;
-        note->envelopes[i].now_delta = note->envelopes[i].deltas[KS_ENVELOPE_RELEASE_INDEX];
-        note->envelopes[i].now_point_amp=  note->envelopes[i].points[KS_ENVELOPE_RELEASE_INDEX];
+        note->envelopes[i].now_delta = note->envelope_setups[i].deltas[KS_ENVELOPE_RELEASE_INDEX];
+        note->envelopes[i].now_point_amp=  note->envelope_setups[i].points[KS_ENVELOPE_RELEASE_INDEX];
 
     }
 }
 
+void ks_synth_note_retrigger(ks_synth_note* note, const ks_synth* synth, const ks_synth_context* ctx, u8 notenum, u8 velocity){
+    i32 amps[KS_NUM_ENVELOPES];
+    for(unsigned i=0; i< KS_NUM_ENVELOPES; i++){
+        amps[i] = note->envelopes[i].now_amp;
+    }
+
+    ks_synth_note_on(note, synth, ctx, notenum, velocity);
+
+    // first segment goes from current level to the first point
+    for(unsigned i=0; i< KS_NUM_ENVELOPES; i++){
+        note->envelopes[i].now_amp = amps[i];
+        note->envelopes[i].now_diff = note->envelope_setups[i].points[0] - amps[i];
+    }
+}
+
+void ks_synth_note_choke(ks_synth_note* note, u32 frames){
+    ks_synth_note_off(note);
+
+    const i32 time = MAX(frames >> KS_UPDATE_PER_FRAMES_BITS, 1u);
+    for(unsigned i=0; i< KS_NUM_ENVELOPES; i++){
+        if(note->envelopes[i].now_time > time){
+            note->envelopes[i].now_time = time;
+            note->envelopes[i].now_delta = ks_1(KS_ENVELOPE_BITS) / time;
+        }
+    }
+}
+
 KS_FORCEINLINE static void ks_envelope_update_clock(ks_synth_note* note, int i){
     note->envelopes[i].update_clock = ks_mask(--note->envelopes[i].update_clock, KS_UPDATE_PER_FRAMES_BITS);
 }
@@ -547,17 +712,17 @@ KS_NOINLINE static void ks_calclate_envelope(const ks_synth_context*ctx, ks_synt
                 note->envelopes[i].now_point ++;
                 point = note->envelopes[i].now_point;
 
-                note->envelopes[i].now_delta = note->envelopes[i].deltas[point];
-                note->envelopes[i].now_time = note->envelopes[i].samples[point];
-                note->envelopes[i].now_diff = note->envelopes[i].diffs[point];
+                note->envelopes[i].now_delta = note->envelope_setups[i].deltas[point];
+                note->envelopes[i].now_time = note->envelope_setups[i].samples[point];
+                note->envelopes[i].now_diff = note->envelope_setups[i].diffs[point];
             }
-            note->envelopes[i].now_point_amp=  note->envelopes[i].points[point];
+            note->envelopes[i].now_point_amp=  note->envelope_setups[i].points[point];
             break;
         case KS_ENVELOPE_RELEASED:
             point = note->envelopes[i].now_point;
             note->envelopes[i].now_delta = 0;
             note->envelopes[i].now_diff = 0;
-            note->envelopes[i].now_point_amp=  note->envelopes[i].points[point];
+            note->envelopes[i].now_point_amp=  note->envelope_setups[i].points[point];
             note->envelopes[i].state = KS_ENVELOPE_OFF;
             break;
         }
@@ -599,7 +764,15 @@ static i32 KS_FORCEINLINE ks_synth_biquad_filter_apply(ks_synth_note* note, i32
     return out;
 }
 
-static void KS_FORCEINLINE ks_synth_filter_calclate(const ks_synth_context* ctx, ks_synth_note* note, i32* buf[], u32 i, u8 type, bool lfo, u32 lfo_index){
+KS_FORCEINLINE static i32 ks_synth_lfo_value(const ks_synth* synth, u32 l, u32 phase){
+    i32 out = synth->lfo_wave_tables[l][ks_mask(phase >> KS_PHASE_BITS, KS_TABLE_BITS)];
+    out *= synth->lfo_levels[l];
+    out >>= KS_LEVEL_BITS;
+    return out;
+}
+
+// lfo_phases of note are of the beginning of the piece, the filter reads the LFO at sample i directly
+static void KS_FORCEINLINE ks_synth_filter_calclate(const ks_synth_context* ctx, ks_synth_note* note, u32 i, bool lfo, u32 lfo_index){
     const ks_synth* synth = note->synth;
 
     const u32 cutoff = note->filter_cutoff;
@@ -610,7 +783,9 @@ static void KS_FORCEINLINE ks_synth_filter_calclate(const ks_synth_context* ctx,
     i32 envelope_level = ctx->powerof2[envelope_amp];
 
     if(lfo) {
-       i32 lfo_amp =(ks_1(KS_OUTPUT_BITS) + buf[lfo_index][i]) >> (KS_OUTPUT_BITS - KS_TABLE_BITS + 1);
+       const u32 l = lfo_index - 1;
+       const i32 lfo_value = ks_synth_lfo_value(synth, l, note->lfo_phases[l] + i*synth->lfo_deltas[l]);
+       i32 lfo_amp =(ks_1(KS_OUTPUT_BITS) + lfo_value) >> (KS_OUTPUT_BITS - KS_TABLE_BITS + 1);
        lfo_amp = ctx->powerof2[lfo_amp];
        envelope_level = ((i64)envelope_level * lfo_amp) >> (KS_POWER_OF_2_BITS+2);
     }
@@ -618,60 +793,24 @@ static void KS_FORCEINLINE ks_synth_filter_calclate(const ks_synth_context* ctx,
     const i64 omega0_ = ((i64)cutoff * envelope_level) >> (KS_POWER_OF_2_BITS+2);
 
     const u32 omega0 = MAX(MIN(omega0_, ks_1(KS_PHASE_MAX_BITS-1)), ks_1(KS_PHASE_BITS));
-    const i32 sin_omega0 = ks_sin(ctx, omega0);
-    const i32 cos_omega0 = ks_sin(ctx, omega0 + ks_1(KS_PHASE_BITS + KS_TABLE_BITS - 2));
-
-    const i32 alpha = ks_v((i64)sin_omega0, KS_FILTER_Q_BITS) / synth->filter_q;
-
-    i32 a0, a1, a2, b0, b1, b2;
-
-    switch (type) {
-    case KS_LOW_PASS_FILTER:
-        a0 = ks_1(KS_OUTPUT_BITS) + alpha;
-        a1 = (-cos_omega0) << 1;
-        a2 = ks_1(KS_OUTPUT_BITS) - alpha;
-        b1 = ks_1(KS_OUTPUT_BITS) - cos_omega0;
-        b0 = b2 = b1 >> 1;
-        break;
-    case KS_HIGH_PASS_FILTER:
-        a0 = ks_1(KS_OUTPUT_BITS) + alpha;
-        a1 = (-cos_omega0) << 1;
-        a2 = ks_1(KS_OUTPUT_BITS) - alpha;
-        b1 = ks_1(KS_OUTPUT_BITS) + cos_omega0;
-        b0 = b2 = b1 >> 1;
-        b1 = -b1;
-        break;
-    case KS_BAND_PASS_FILTER:
-        a0 = ks_1 (KS_OUTPUT_BITS)+ alpha;
-        a1 = (-cos_omega0) << 1;
-        a2 = ks_1(KS_OUTPUT_BITS) - alpha;
-        b0 = sin_omega0 >> 1;
-        b1 = 0;
-        b2 = -b0;
-        break;
-    }
+    const ks_biquad_coefs* coefs = &synth->filter_coefs[omega0 >> KS_PHASE_BITS];
 
-    i64 a0inv = ks_v(1ll, KS_OUTPUT_BITS*2 + KS_OUTPUT_BITS) / a0;
-    note->a1a0 = ((i64)a1 * a0inv) >> (KS_OUTPUT_BITS*2);
-    note->a2a0 = ((i64)a2 * a0inv) >> (KS_OUTPUT_BITS*2);
+    note->a1a0 = coefs->a1a0;
+    note->a2a0 = coefs->a2a0;
 
-    note->b0a0 = ((i64)b0 * a0inv) >> (KS_OUTPUT_BITS*2);
-    note->b1a0 = ((i64)b1 * a0inv) >> (KS_OUTPUT_BITS*2);
-    note->b2a0 = ((i64)b2 * a0inv) >> (KS_OUTPUT_BITS*2);
+    note->b0a0 = coefs->b0a0;
+    note->b1a0 = coefs->b1a0;
+    note->b2a0 = coefs->b2a0;
 
 }
 
-static void KS_FORCEINLINE ks_synth_biquad_filter_base(const ks_synth_context* ctx, ks_synth_note* note, i32* buf[], u32 len, u8 type, bool lfo, u32 lfo_index){
+static void KS_FORCEINLINE ks_synth_biquad_filter_base(const ks_synth_context* ctx, ks_synth_note* note, i32* buf[], u32 len, bool lfo, u32 lfo_index){
     i32* outbuf = buf[0];
-    i32* lfobufs[KS_NUM_LFOS];
-    for(unsigned i=0; i<KS_NUM_LFOS; i++){
-        lfobufs[i] = buf[i+1];
-    }
 
     for(u32 i=0; i< len; i++){
         if(note->envelopes[1].update_clock == 0){
             ks_envelope_process(ctx, note, 1);
-            ks_synth_filter_calclate(ctx, note, buf, i, type, lfo, lfo_index);
+            ks_synth_filter_calclate(ctx, note, i, lfo, lfo_index);
         }
         ks_envelope_update_clock(note, 1);
 
@@ -679,42 +818,124 @@ static void KS_FORCEINLINE ks_synth_biquad_filter_base(const ks_synth_context* c
     }
 }
 
-#define ks_synth_apply_filter_func(type, lfo) ks_filter_apply_ ## type ## _ ## lfo
+#define ks_synth_apply_filter_func(lfo) ks_filter_apply_ ## lfo
 
-#define ks_synth_apply_filter_impl(type, lfo) static void KS_NOINLINE ks_synth_apply_filter_func(type, lfo) (const ks_synth_context* ctx, ks_synth_note* note, i32* buf[], u32 len, u32 lfo_index) { \
-    ks_synth_biquad_filter_base(ctx, note, buf, len, type, lfo, lfo_index); \
+#define ks_synth_apply_filter_impl(lfo) static void KS_NOINLINE ks_synth_apply_filter_func(lfo) (const ks_synth_context* ctx, ks_synth_note* note, i32* buf[], u32 len, u32 lfo_index) { \
+    ks_synth_biquad_filter_base(ctx, note, buf, len, lfo, lfo_index); \
 }
 
-#define ks_synth_apply_filter_impl_lfo(type) \
-    ks_synth_apply_filter_impl(type, 0) \
-    ks_synth_apply_filter_impl(type, 1)
+ks_synth_apply_filter_impl(0)
+ks_synth_apply_filter_impl(1)
+
+// [lfo], the filter type is in coefficients of the synth
+static const ks_synth_filter_func ks_synth_apply_filter_funcs[2] = {
+    ks_synth_apply_filter_func(0), ks_synth_apply_filter_func(1),
+};
+
+// same as ks_synth_apply_filter_base for each notes, but coefficients of all notes are calculated first, and then notes are filtered in lanes
+static void KS_FORCEINLINE ks_synth_apply_filter_voices_base(const ks_synth_context* ctx, ks_synth_render_buffer* rb, ks_synth_note* notes[], u32 num_notes, u32 len, bool lfo, u32 lfo_index){
+    i32* outbufs[KS_SYNTH_MAX_LANES];
+    u32 next_updates[KS_SYNTH_MAX_LANES];
+    ks_simd_biquad f;
+
+    i32* row = rb->filter_coefs;
+    u32* starts = rb->filter_starts;
+
+    memset(&f, 0, sizeof(f));
+    memset(row, 0, sizeof(i32)*KS_SIMD_BIQUAD_ROW);
+    *starts = 0;
+
+    for(unsigned l=0; l<KS_SYNTH_MAX_LANES; l++){
+        // unused lanes filter the mix buffer with zero coefficients, it is not used yet
+        if(l >= num_notes){
+            outbufs[l] = rb->mixbuf;
+            next_updates[l] = UINT32_MAX;
+            continue;
+        }
+
+        ks_synth_note* note = notes[l];
+        const unsigned pre1 = ks_mask(note->filter_seek, KS_FILTER_LOG_BITS);
+        const unsigned pre2 = ks_mask(note->filter_seek-1, KS_FILTER_LOG_BITS);
 
-ks_synth_apply_filter_impl_lfo(KS_LOW_PASS_FILTER)
-ks_synth_apply_filter_impl_lfo(KS_HIGH_PASS_FILTER)
-ks_synth_apply_filter_impl_lfo(KS_BAND_PASS_FILTER)
+        outbufs[l] = rb->bufs[l][0];
+        f.in1[l] = note->filter_in_logs[pre1];
+        f.in2[l] = note->filter_in_logs[pre2];
+        f.out1[l] = note->filter_out_logs[pre1];
+        f.out2[l] = note->filter_out_logs[pre2];
 
-static void KS_FORCEINLINE ks_synth_apply_filter(const ks_synth_context* ctx, ks_synth_note* note, i32* buf[], u32 len){
-#define lfo_branch(type)  \
-    if(synth->lfo_filter_enabled == 0) { \
-        ks_synth_apply_filter_func(type, 0)(ctx, note, buf, len, 0); \
-    } else { \
-        ks_synth_apply_filter_func(type, 1)(ctx, note, buf, len, synth->lfo_filter_enabled); \
+        row[l] = note->b0a0;
+        row[l + KS_SYNTH_MAX_LANES] = note->b1a0;
+        row[l + 2*KS_SYNTH_MAX_LANES] = note->b2a0;
+        row[l + 3*KS_SYNTH_MAX_LANES] = note->a1a0;
+        row[l + 4*KS_SYNTH_MAX_LANES] = note->a2a0;
+
+        next_updates[l] = note->envelopes[1].update_clock;
     }
 
-    const ks_synth* synth = note->synth;
-    switch(note->synth->filter_type){
-    case KS_LOW_PASS_FILTER:
-        lfo_branch(KS_LOW_PASS_FILTER);
-        break;
-    case KS_HIGH_PASS_FILTER:
-         lfo_branch(KS_HIGH_PASS_FILTER);
-        break;
-    case KS_BAND_PASS_FILTER:
-         lfo_branch(KS_BAND_PASS_FILTER);
-        break;
+    // a row is added at each sample where some notes update coefficients
+    for(;;){
+        u32 i = UINT32_MAX;
+        for(unsigned l=0; l<num_notes; l++){
+            i = MIN(i, next_updates[l]);
+        }
+        if(i >= len) break;
+
+        if(i != *starts){
+            memcpy(row + KS_SIMD_BIQUAD_ROW, row, sizeof(i32)*KS_SIMD_BIQUAD_ROW);
+            row += KS_SIMD_BIQUAD_ROW;
+            *++starts = i;
+        }
+
+        for(unsigned l=0; l<num_notes; l++){
+            if(next_updates[l] != i) continue;
+
+            ks_synth_note* note = notes[l];
+            note->envelopes[1].update_clock = 0;
+            ks_envelope_process(ctx, note, 1);
+            ks_synth_filter_calclate(ctx, note, i, lfo, lfo_index);
+            ks_envelope_update_clock(note, 1);
+
+            row[l] = note->b0a0;
+            row[l + KS_SYNTH_MAX_LANES] = note->b1a0;
+            row[l + 2*KS_SYNTH_MAX_LANES] = note->b2a0;
+            row[l + 3*KS_SYNTH_MAX_LANES] = note->a1a0;
+            row[l + 4*KS_SYNTH_MAX_LANES] = note->a2a0;
+
+            next_updates[l] = i + 1 + note->envelopes[1].update_clock;
+        }
     }
+    *++starts = UINT32_MAX;
+
+    ks_simd_biquad_voices(ctx->simd, &f, rb->filter_coefs, rb->filter_starts, outbufs, len);
+
+    for(unsigned l=0; l<num_notes; l++){
+        ks_synth_note* note = notes[l];
+        note->envelopes[1].update_clock = next_updates[l] - len;
+        note->filter_seek += len;
+
+        const unsigned pre1 = ks_mask(note->filter_seek, KS_FILTER_LOG_BITS);
+        const unsigned pre2 = ks_mask(note->filter_seek-1, KS_FILTER_LOG_BITS);
+        note->filter_in_logs[pre1] = f.in1[l];
+        note->filter_in_logs[pre2] = f.in2[l];
+        note->filter_out_logs[pre1] = f.out1[l];
+        note->filter_out_logs[pre2] = f.out2[l];
+    }
+}
+
+#define ks_synth_apply_filter_voices_func(lfo) ks_filter_apply_voices_ ## lfo
+
+#define ks_synth_apply_filter_voices_impl(lfo) static void KS_NOINLINE ks_synth_apply_filter_voices_func(lfo) (const ks_synth_context* ctx, ks_synth_render_buffer* rb, ks_synth_note* notes[], u32 num_notes, u32 len, u32 lfo_index) { \
+    ks_synth_apply_filter_voices_base(ctx, rb, notes, num_notes, len, lfo, lfo_index); \
 }
 
+ks_synth_apply_filter_voices_impl(0)
+ks_synth_apply_filter_voices_impl(1)
+
+// [lfo], the filter type is in coefficients of the synth
+static const ks_synth_filter_voices_func ks_synth_apply_filter_voices_funcs[2] = {
+    ks_synth_apply_filter_voices_func(0), ks_synth_apply_filter_voices_func(1),
+};
+
 static void KS_FORCEINLINE ks_synth_render_mod_base(ks_synth_note* note, u32 op, u32 pitchbend, i32*buf[], u32 len, u32 mod_type, bool fm, bool sync, bool ams, bool fms, bool noise){
     if(mod_type == KS_MOD_PASS) return;
 
@@ -778,8 +999,7 @@ static void KS_FORCEINLINE ks_synth_render_mod_base(ks_synth_note* note, u32 op,
 
             if(noise){
                 if(ks_mask(note->operators[0].phase >> shift, KS_TABLE_BITS) > ks_mask((note->operators[0].phase + note->operators[0].phase_delta) >> shift, KS_TABLE_BITS)){
-                    srand(note->noise_table_offset);
-                    note->noise_table_offset = rand();
+                    note->noise_table_offset = ks_noise_next(note->noise_table_offset);
                 }
             }
         }
@@ -831,7 +1051,9 @@ ks_synth_render_impl_mod_fm(0, 0, 1)
 ks_synth_render_impl_mod_fm(0, 1, 0)
 ks_synth_render_impl_mod_fm(0, 1, 1)
 ks_synth_render_impl_mod_fm(1, 0, 0)
+ks_synth_render_impl_mod_fm(1, 0, 1)
 ks_synth_render_impl_mod_fm(1, 1, 0)
+ks_synth_render_impl_mod_fm(1, 1, 1)
 
 ks_synth_render_impl(KS_NUM_MODS, 0, 0, 0, 0, 0)
 ks_synth_render_impl(KS_NUM_MODS, 0, 0, 0, 1, 0)
@@ -843,115 +1065,144 @@ ks_synth_render_impl(KS_NUM_MODS, 0, 0, 1, 0, 1)
 ks_synth_render_impl(KS_NUM_MODS, 0, 0, 1, 1, 1)
 
 
-static void KS_FORCEINLINE ks_synth_render_branch(const ks_synth_context* ctx, ks_synth_note* note, u32 op, u32 pitchbend, i32* buf[], u32 len){
-#define fm_branch(mod, sync, ams, fms) \
-if(fm) { \
-    ks_synth_render_func(mod, 1, sync, ams, fms, 0)(note, op, pitchbend, buf, len); \
-}else{ \
-    ks_synth_render_func(mod, 0, sync, ams, fms, 0)(note, op, pitchbend, buf, len); \
-}
-
-#define fms_branch(mod, sync, ams) \
-    if(fms){ \
-       fm_branch(mod, sync, ams, 1); \
-    } else { \
-       fm_branch(mod, sync, ams, 0); \
-    }
-
-#define sync_lfo_branch(mod)  { \
-        const u32 preop = op-1; \
-        const bool fm = synth->mods[preop].fm_level != 0; \
-        const bool sync = synth->mods[preop].sync; \
-        const bool ams = synth->operators[op].lfo_op_enable[0]; \
-        const bool fms = synth->operators[op].lfo_op_enable[1]; \
-        if(sync){ \
-            if(ams){ \
-               fm_branch(mod, 1, 1, 0); \
-            } else { \
-               fm_branch(mod, 1, 0, 0); \
-            } \
-        } else { \
-            if(ams){ \
-                fms_branch(mod, 0, 1); \
-            } else { \
-                fms_branch(mod, 0, 0); \
-            } \
-        } \
-    }
+#define ks_synth_render_funcs_fms(mod, fm, sync, ams)  { ks_synth_render_func(mod, fm, sync, ams, 0, 0), ks_synth_render_func(mod, fm, sync, ams, 1, 0) }
+#define ks_synth_render_funcs_ams(mod, fm, sync)       { ks_synth_render_funcs_fms(mod, fm, sync, 0), ks_synth_render_funcs_fms(mod, fm, sync, 1) }
+#define ks_synth_render_funcs_sync(mod, fm)            { ks_synth_render_funcs_ams(mod, fm, 0), ks_synth_render_funcs_ams(mod, fm, 1) }
+#define ks_synth_render_funcs_fm(mod)                  { ks_synth_render_funcs_sync(mod, 0), ks_synth_render_funcs_sync(mod, 1) }
+
+// [mod type][fm][sync][ams][fms]
+static const ks_synth_operator_func ks_synth_render_funcs[KS_MOD_PASS][2][2][2][2] = {
+    ks_synth_render_funcs_fm(KS_MOD_MIX),
+    ks_synth_render_funcs_fm(KS_MOD_MUL),
+    ks_synth_render_funcs_fm(KS_MOD_AM),
+};
+
+#define ks_synth_render_funcs_0_noise(ams, fms)         { ks_synth_render_func(KS_NUM_MODS, 0, 0, ams, fms, 0), ks_synth_render_func(KS_NUM_MODS, 0, 0, ams, fms, 1) }
+#define ks_synth_render_funcs_0_fms(ams)                { ks_synth_render_funcs_0_noise(ams, 0), ks_synth_render_funcs_0_noise(ams, 1) }
+
+// operator 0, [ams][fms][noise]
+static const ks_synth_operator_func ks_synth_render_funcs_0[2][2][2] = {
+    ks_synth_render_funcs_0_fms(0),
+    ks_synth_render_funcs_0_fms(1),
+};
 
+#undef ks_synth_render_funcs_fms
+#undef ks_synth_render_funcs_ams
+#undef ks_synth_render_funcs_sync
+#undef ks_synth_render_funcs_fm
+#undef ks_synth_render_funcs_0_noise
+#undef ks_synth_render_funcs_0_fms
+
+static u32 KS_FORCEINLINE ks_synth_render_simd(const ks_synth_context* ctx, ks_synth_note* note, u32 op, u32 pitchbend, i32* buf[], u32 len, u32 mod_type, bool fm, bool ams){
     const ks_synth* synth = note->synth;
-    switch (synth->mods[op-1].type) {
-    case KS_MOD_MIX:
-        sync_lfo_branch(KS_MOD_MIX);
-        break;
-    case KS_MOD_MUL:
-        sync_lfo_branch(KS_MOD_MUL);
-        break;
-    case KS_MOD_AM:
-        sync_lfo_branch(KS_MOD_AM);
-        break;
-    case KS_MOD_PASS:
-        return;
+
+    ks_simd_operator simd_op = {
+        .wave_table = synth->operators[op].wave_table,
+        .phase = note->operators[op].phase,
+        .phase_delta = ((u64)note->operators[op].phase_delta * pitchbend) >> KS_PITCH_BEND_BITS,
+    };
+    // operator 0 has no modulator
+    if(op != 0){
+        simd_op.fm_level = synth->mods[op-1].fm_level;
+        simd_op.mod_level = synth->mods[op-1].mod_level;
+        simd_op.output_level = synth->mods[op-1].output_level;
     }
-#undef sync_lfo_branch
-#undef fm_branch
-#undef fms_branch
+
+    const u32 rendered = ks_simd_render_operator(ctx->simd, &simd_op, buf[0], buf[1], len, mod_type, fm, ams);
+    note->operators[op].phase = simd_op.phase;
+
+    return rendered;
 }
 
-static void KS_FORCEINLINE ks_synth_render_0(const ks_synth_context* ctx, ks_synth_note* note, u32 pitchbend, i32*buf[], u32 len){
-#define noise_table_branch(ams, fms) \
-    if(noise_table) { \
-        ks_synth_render_func(KS_NUM_MODS, 0, 0, ams, fms, 1)(note, 0, pitchbend, buf, len); \
-    } else { \
-        ks_synth_render_func(KS_NUM_MODS, 0, 0, ams, fms, 0)(note, 0, pitchbend, buf, len); \
+// render by vectorized kernel as far as possible, then by specialized scalar functions
+static void KS_FORCEINLINE ks_synth_render_operator(const ks_synth_context* ctx, ks_synth_note* note, const ks_synth_operator_stage* stage, u32 pitchbend, i32* buf[], u32 len){
+    u32 rendered = 0;
+    if(stage->simd && ctx->simd != KS_SIMD_NONE){
+        rendered = ks_synth_render_simd(ctx, note, stage->op, pitchbend, buf, len, stage->mod_type, stage->fm, stage->ams);
     }
 
-#define fms_branch(ams) \
-    if(fms){ \
-       noise_table_branch(ams, 1); \
-    } else { \
-       noise_table_branch(ams, 0); \
-    }
+    if(rendered == len) return;
 
-    const ks_synth* synth = note->synth;
-    const bool noise_table = synth->operators[0].wave_table == ctx->wave_tables[KS_WAVE_NOISE];
-    const bool ams = synth->operators[0].lfo_op_enable[0];
-    const bool fms = synth->operators[0].lfo_op_enable[1];
-    if(ams){
-        fms_branch(1);
-    } else {
-        fms_branch(0);
+    i32* rest[KS_NUM_LFOS+1];
+    for(unsigned i=0; i<KS_NUM_LFOS+1; i++){
+        rest[i] = buf[i] + rendered;
     }
 
-#undef noise_table_branch
-#undef fms_branch
+    stage->render(note, stage->op, pitchbend, rest, len - rendered);
 }
 
+// LFO is calculated once in KS_UPDATE_PER_FRAMES samples and interpolated linearly between them,
+// except of noise which does not continue between samples.
+// lfo_phases of note are not advanced, it is done by ks_synth_advance_lfos after all stages.
+static void KS_NOINLINE ks_synth_render_lfo(const ks_synth_context* ctx, ks_synth_note* note, u32 l, i32* buf, u32 len){
+    const ks_synth* synth = note->synth;
+    u32 phase = note->lfo_phases[l];
 
+    if(synth->lfo_wave_tables[l] == ctx->wave_tables[KS_WAVE_NOISE]){
+        for(u32 i=0; i<len; i++){
+            buf[i] = ks_synth_lfo_value(synth, l, phase);
+            phase += synth->lfo_deltas[l];
+        }
+        return;
+    }
 
-static void KS_NOINLINE ks_synth_render_lfo(const ks_synth_context* ctx, ks_synth_note* note, u32 l, i32* buf, u32 len){
+    const u32 delta = synth->lfo_deltas[l] << KS_UPDATE_PER_FRAMES_BITS;
+    i32 now = ks_synth_lfo_value(synth, l, phase);
+
+    for(u32 i=0; i<len; i+= KS_UPDATE_PER_FRAMES){
+        phase += delta;
+        const i32 next = ks_synth_lfo_value(synth, l, phase);
+        const i32 diff = next - now;
+        const u32 run = MIN(len - i, KS_UPDATE_PER_FRAMES);
+        for(u32 k=0; k<run; k++){
+            buf[i + k] = now + ((diff * (i32)k) >> KS_UPDATE_PER_FRAMES_BITS);
+        }
+        now = next;
+    }
+}
+
+static void ks_synth_advance_lfos(ks_synth_note* note, u32 len){
     const ks_synth* synth = note->synth;
-    for(unsigned i =0; i<len; i++){
-        i32 out = synth->lfo_wave_tables[l][ks_mask(note->lfo_phases[l] >> KS_PHASE_BITS, KS_TABLE_BITS)];
-        out *= synth->lfo_levels[l];
-        out >>= KS_LEVEL_BITS;
-        buf[i] = out;
-        note->lfo_phases[l] += synth->lfo_deltas[l];
+    for(unsigned l=0; l<KS_NUM_LFOS; l++){
+        note->lfo_phases[l] += len * synth->lfo_deltas[l];
     }
 }
 
-static void KS_NOINLINE ks_synth_apply_envelope(const ks_synth_context* ctx, ks_synth_note* note, i32*buf, u32 len){
-    for(unsigned i=0; i<len; i++){
-        ks_envelope_process(ctx, note, 0);
+// same as ks_envelope_process for each samples, level is updated once in KS_UPDATE_PER_FRAMES samples
+static void ks_synth_envelope_gains(const ks_synth_context* ctx, ks_synth_note* note, i32* gains, u32 len){
+    ks_synth_note_envelope* envelope = &note->envelopes[0];
 
-        i64 amp = note->envelopes[0].now_amp;
-        amp *= buf[i];
-        amp >>= KS_ENVELOPE_BITS;
+    // level does not move until note off
+    if(envelope->state == KS_ENVELOPE_SUSTAINED || envelope->state == KS_ENVELOPE_OFF){
+        const i32 amp = envelope->now_amp;
+        for(u32 i=0; i<len; i++){
+            gains[i] = amp;
+        }
+        envelope->update_clock = ks_mask(envelope->update_clock - len, KS_UPDATE_PER_FRAMES_BITS);
+        return;
+    }
 
-        buf[i] = amp;
+    for(u32 i=0; i<len; ){
+        u32 run = envelope->update_clock;
+        if(run == 0){
+            ks_calclate_envelope(ctx, note, 0);
+            run = KS_UPDATE_PER_FRAMES;
+        }
+        run = MIN(run, len - i);
+        envelope->update_clock = ks_mask(envelope->update_clock - run, KS_UPDATE_PER_FRAMES_BITS);
+
+        const i32 amp = envelope->now_amp;
+        for(const u32 end = i + run; i<end; i++){
+            gains[i] = amp;
+        }
     }
 }
 
+static void ks_synth_apply_envelope(const ks_synth_context* ctx, ks_synth_render_buffer* rb, ks_synth_note* note, i32*buf, u32 len){
+    ks_synth_envelope_gains(ctx, note, rb->envelope_gains, len);
+    ks_simd_apply_gains(ctx->simd, buf, rb->envelope_gains, len);
+}
+
 static void KS_FORCEINLINE ks_synth_apply_panpot_base(const ks_synth_context*ctx, ks_synth_note*note, i32* buf, i32*bufs[], u32 len, bool lfo, u32 lfo_index){
     const ks_synth* synth = note->synth;
     i32* inbuf = bufs[0];
@@ -959,30 +1210,28 @@ static void KS_FORCEINLINE ks_synth_apply_panpot_base(const ks_synth_context*ctx
 
     i16 pan_left;
     i16 pan_right;
+    ks_calc_panpot(ctx, &pan_left, &pan_right, synth->panpot << (KS_PANPOT_BITS - 7));
 
     if(!lfo){
-        ks_calc_panpot(ctx, &pan_left, &pan_right, synth->panpot << (KS_PANPOT_BITS - 7));
+        for(unsigned i=0; i<len; i++){
+            buf[2*i] += ks_apply_panpot(inbuf[i], pan_left) >> 1;
+            buf[2*i+1] += ks_apply_panpot(inbuf[i], pan_right) >> 1;
+        }
+        return;
     }
 
-    for(unsigned i=0; i<len; i++){
-        if(lfo){
-            const u32 fac = 92682; // sqrt(2)<<16
-
-            ks_calc_panpot(ctx, &pan_left, &pan_right, synth->panpot << (KS_PANPOT_BITS - 7));
-
-            i32 pan = ks_1(KS_PANPOT_BITS-1) + (lfobuf[i] >> (KS_OUTPUT_BITS - KS_PANPOT_BITS +1));
-            i16 pan_left2, pan_right2;
-
-            ks_calc_panpot(ctx, &pan_left2, &pan_right2, pan);
+    // gains of LFO come from the table, then stereo samples are written by vector
+    i32 gains[2*KS_SYNTH_PANPOT_LFO_FRAMES];
+    for(u32 i=0; i<len; i+= KS_SYNTH_PANPOT_LFO_FRAMES){
+        const u32 frames = MIN(len - i, KS_SYNTH_PANPOT_LFO_FRAMES);
+        for(u32 j=0; j<frames; j++){
+            const i32 pan = ks_1(KS_PANPOT_BITS-1) + (lfobuf[i+j] >> (KS_OUTPUT_BITS - KS_PANPOT_BITS +1));
+            const i16* lfo_gains = ctx->panpot_lfo_gains[ks_mask(pan >> KS_PANPOT_LFO_GAINS_SHIFT, KS_TABLE_BITS)];
 
-            const i32 pan_left3 = ((i32)pan_left2 * fac) >> 16;
-            const i32 pan_right3 = ((i32)pan_right2 * fac) >> 16;
-            pan_left = ((i32)pan_left * pan_left3) >> KS_OUTPUT_BITS;
-            pan_right = ((i32)pan_right* pan_right3) >> KS_OUTPUT_BITS;
+            gains[2*j] = (i16)(((i32)pan_left * lfo_gains[0]) >> KS_OUTPUT_BITS);
+            gains[2*j+1] = (i16)(((i32)pan_right * lfo_gains[1]) >> KS_OUTPUT_BITS);
         }
-
-        buf[2*i] = ks_apply_panpot(inbuf[i], pan_left) >> 1;
-        buf[2*i+1] = ks_apply_panpot(inbuf[i], pan_right) >> 1;
+        ks_simd_add_panned(ctx->simd, buf + 2*i, inbuf + i, gains, frames);
     }
 }
 
@@ -996,55 +1245,486 @@ static void KS_FORCEINLINE ks_synth_apply_panpot_base(const ks_synth_context*ctx
 ks_synth_apply_panpot_impl(0)
 ks_synth_apply_panpot_impl(1)
 
-KS_FORCEINLINE static void ks_synth_apply_panpot_branch(const ks_synth_context* ctx, ks_synth_note* note, i32* buf, i32*bufs[], u32 len) {
+static const ks_synth_panpot_func ks_synth_apply_panpot_funcs[2] = {
+    ks_synth_apply_panpot_func(0),
+    ks_synth_apply_panpot_func(1),
+};
+
+// operators, filter, envelope, volume and panpot in one pass over tiles of at most KS_UPDATE_PER_FRAMES samples,
+// intermediate values stay in registers and the tile. Results are same as separated stages.
+// It renders notes which do not use LFOs, synchronization nor the noise table.
+static void KS_FORCEINLINE ks_synth_render_fused_base(const ks_synth_context*ctx, ks_synth_note* note, u32 volume, u32 pitchbend, i32* buf, u32 len, u32 num_operators, bool filter, bool mono){
     const ks_synth* synth = note->synth;
-    if(synth->lfo_panpot_enabled == 0) {
-        ks_synth_apply_panpot_func(0)(ctx, note, buf, bufs, len, 0);
+    const ks_synth_render_plan* plan = &synth->plan;
+
+    const i16*  wave_tables     [KS_NUM_OPERATORS];
+    u32         phases          [KS_NUM_OPERATORS];
+    u32         phase_deltas    [KS_NUM_OPERATORS];
+    u32         fm_levels       [KS_NUM_OPERATORS];
+    u32         mod_levels      [KS_NUM_OPERATORS];
+    u32         output_levels   [KS_NUM_OPERATORS];
+    u8          mod_types       [KS_NUM_OPERATORS];
+    i32         mod_offsets     [KS_NUM_OPERATORS];
+    u8          mod_shifts      [KS_NUM_OPERATORS];
+
+    for(unsigned s=0; s<num_operators; s++){
+        const ks_synth_operator_stage* stage = &plan->operators[s];
+        const u32 op = stage->op;
+        wave_tables[s] = synth->operators[op].wave_table;
+        phases[s] = note->operators[op].phase;
+        phase_deltas[s] = ((u64)note->operators[op].phase_delta * pitchbend) >> KS_PITCH_BEND_BITS;
+        mod_types[s] = stage->mod_type;
+        if(s != 0){
+            const ks_synth_mod* mod = &synth->mods[op-1];
+            fm_levels[s] = stage->fm ? mod->fm_level : 0;
+            mod_levels[s] = mod->mod_level;
+            output_levels[s] = mod->output_level;
+            mod_offsets[s] = stage->mod_type == KS_MOD_AM ? ks_1(KS_OUTPUT_BITS) : 0;
+            mod_shifts[s] = stage->mod_type == KS_MOD_MIX ? 0 : stage->mod_type == KS_MOD_MUL ? KS_OUTPUT_BITS : KS_OUTPUT_BITS+1;
+        }
+    }
+
+    i16 pan_left = 0;
+    i16 pan_right = 0;
+    if(!mono){
+        ks_calc_panpot(ctx, &pan_left, &pan_right, synth->panpot << (KS_PANPOT_BITS - 7));
+    }
+
+    for(u32 i=0; i<len; ){
+        // envelopes and filter coefficients are constant until the next update clock
+        ks_synth_note_envelope* envelope = &note->envelopes[0];
+        u32 run = envelope->update_clock;
+        if(run == 0){
+            // as ks_synth_envelope_gains, retired notes keep their level
+            if(envelope->state != KS_ENVELOPE_OFF){
+                ks_calclate_envelope(ctx, note, 0);
+            }
+            run = KS_UPDATE_PER_FRAMES;
+        }
+        if(filter){
+            if(note->envelopes[1].update_clock == 0){
+                ks_envelope_process(ctx, note, 1);
+                ks_synth_filter_calclate(ctx, note, i, false, 0);
+            }
+            run = MIN(run, note->envelopes[1].update_clock);
+        }
+        run = MIN(run, len - i);
+        envelope->update_clock = ks_mask(envelope->update_clock - run, KS_UPDATE_PER_FRAMES_BITS);
+        if(filter){
+            note->envelopes[1].update_clock = ks_mask(note->envelopes[1].update_clock - run, KS_UPDATE_PER_FRAMES_BITS);
+        }
+
+        const i32 amp = envelope->now_amp;
+        const i32 b0a0 = note->b0a0, b1a0 = note->b1a0, b2a0 = note->b2a0, a1a0 = note->a1a0, a2a0 = note->a2a0;
+
+        // samples of a run are independent in operators, so they are rendered operator by operator
+        i32 tile[KS_UPDATE_PER_FRAMES];
+        for(u32 t=0; t<run; t++){
+            tile[t] = wave_tables[0][ks_mask(phases[0] >> KS_PHASE_BITS, KS_TABLE_BITS)];
+            phases[0] += phase_deltas[0];
+        }
+
+        for(unsigned s=1; s<num_operators; s++){
+            for(u32 t=0; t<run; t++){
+                const i32 out = tile[t];
+                i64 fm_amount = out;
+                fm_amount *= fm_levels[s];
+                fm_amount >>= (KS_LEVEL_BITS - 3);
+                fm_amount = ks_v(fm_amount, KS_PHASE_MAX_BITS - KS_OUTPUT_BITS);
+
+                // KS_MOD_MIX : wave, KS_MOD_MUL : wave*out >> 14, KS_MOD_AM : (wave + 1.0)*out >> 15
+                i32 car = wave_tables[s][ks_mask((phases[s] + fm_amount) >> KS_PHASE_BITS, KS_TABLE_BITS)];
+                car = ((car + mod_offsets[s]) * (mod_types[s] == KS_MOD_MIX ? 1 : out)) >> mod_shifts[s];
+
+                const i32 mod = ((i64)out * mod_levels[s]) >> KS_LEVEL_BITS;
+                tile[t] = mod + (i32)(((i64)car * output_levels[s]) >> KS_LEVEL_BITS);
+                phases[s] += phase_deltas[s];
+            }
+        }
+
+        for(u32 t=0; t<run; t++, i++){
+            i32 out = tile[t];
+            if(filter){
+                out = ks_synth_biquad_filter_apply(note, out, b0a0, b1a0, b2a0, a1a0, a2a0);
+            }
+
+            out = ((i64)out * amp) >> KS_ENVELOPE_BITS;
+            out = ((i64)out * volume) >> KS_VOLUME_BITS;
+
+            if(mono){
+                buf[i] += out;
+            } else {
+                buf[2*i] += ks_apply_panpot(out, pan_left) >> 1;
+                buf[2*i+1] += ks_apply_panpot(out, pan_right) >> 1;
+            }
+        }
+    }
+
+    for(unsigned s=0; s<num_operators; s++){
+        note->operators[plan->operators[s].op].phase = phases[s];
+    }
+}
+
+#define ks_synth_render_fused_func(num_operators, filter, mono) ks_synth_render_fused_ ## num_operators ## filter ## mono
+
+#define ks_synth_render_fused_impl(num_operators, filter, mono) \
+    static void KS_NOINLINE ks_synth_render_fused_func(num_operators, filter, mono) (const ks_synth_context* ctx, ks_synth_note* note, u32 volume, u32 pitchbend, i32* buf, u32 len) { \
+        ks_synth_render_fused_base(ctx, note, volume, pitchbend, buf, len, num_operators, filter, mono); \
+    }
+
+#define ks_synth_render_fused_impl_filter(num_operators) \
+    ks_synth_render_fused_impl(num_operators, 0, 0) \
+    ks_synth_render_fused_impl(num_operators, 0, 1) \
+    ks_synth_render_fused_impl(num_operators, 1, 0) \
+    ks_synth_render_fused_impl(num_operators, 1, 1)
+
+ks_synth_render_fused_impl_filter(1)
+ks_synth_render_fused_impl_filter(2)
+ks_synth_render_fused_impl_filter(3)
+ks_synth_render_fused_impl_filter(4)
+
+#define ks_synth_render_fused_funcs_of(num_operators) { \
+        { ks_synth_render_fused_func(num_operators, 0, 0), ks_synth_render_fused_func(num_operators, 0, 1) }, \
+        { ks_synth_render_fused_func(num_operators, 1, 0), ks_synth_render_fused_func(num_operators, 1, 1) }, \
+    }
+
+// [number of operators - 1][filter][mono]
+static const ks_synth_fused_func ks_synth_render_fused_funcs[KS_NUM_OPERATORS][2][2] = {
+    ks_synth_render_fused_funcs_of(1),
+    ks_synth_render_fused_funcs_of(2),
+    ks_synth_render_fused_funcs_of(3),
+    ks_synth_render_fused_funcs_of(4),
+};
+
+// mono output stage instead of panpot, the synth panpot is applied by the caller
+static void ks_synth_apply_mono(i32* buf, const i32* inbuf, u32 len){
+    for(unsigned i=0; i<len; i++){
+        buf[i] += inbuf[i];
+    }
+}
+
+static void ks_synth_render_plan_set(ks_synth_render_plan* plan, const ks_synth* synth, const ks_synth_context* ctx){
+    // LFOs are rendered to buffers for operators and panpot, filter reads them at control rate by itself
+    plan->num_lfos = 0;
+    for(unsigned l=0; l<KS_NUM_LFOS; l++){
+        if(synth->lfo_levels[l] == 0) continue;
+
+        bool audio_rate = synth->lfo_panpot_enabled == l+1;
+        for(unsigned i=0; i<KS_NUM_OPERATORS; i++){
+            audio_rate = audio_rate || synth->operators[i].lfo_op_enable[l];
+        }
+        if(audio_rate){
+            plan->lfos[plan->num_lfos++] = l;
+        }
+    }
+
+    plan->num_operators = 0;
+    for(unsigned i=0; i<KS_NUM_OPERATORS; i++){
+        ks_synth_operator_stage* stage = &plan->operators[plan->num_operators];
+        // LFO of level 0 does not modulate
+        const bool ams = synth->operators[i].lfo_op_enable[0] && synth->lfo_levels[0] != 0;
+        const bool fms = synth->operators[i].lfo_op_enable[1] && synth->lfo_levels[1] != 0;
+
+        stage->op = i;
+        stage->ams = ams;
+        if(i == 0){
+            const bool noise_table = synth->operators[0].wave_table == ctx->wave_tables[KS_WAVE_NOISE];
+            stage->render = ks_synth_render_funcs_0[ams][fms][noise_table];
+            stage->mod_type = KS_NUM_MODS;
+            stage->fm = false;
+            stage->simd = !noise_table && !fms;
+        } else {
+            const ks_synth_mod* mod = &synth->mods[i-1];
+            if(mod->type >= KS_MOD_PASS) continue;
+
+            const bool fm = mod->fm_level != 0;
+            stage->render = ks_synth_render_funcs[mod->type][fm][mod->sync][ams][fms];
+            stage->mod_type = mod->type;
+            stage->fm = fm;
+            stage->simd = !mod->sync && !fms;
+        }
+        plan->num_operators ++;
+    }
+
+    plan->filter = NULL;
+    plan->filter_voices = NULL;
+    plan->filter_lfo_index = synth->lfo_filter_enabled;
+    if(synth->filter_type < KS_NUM_FILTER_TYPES){
+        plan->filter = ks_synth_apply_filter_funcs[synth->lfo_filter_enabled != 0];
+        plan->filter_voices = ks_synth_apply_filter_voices_funcs[synth->lfo_filter_enabled != 0];
+    }
+
+    plan->panpot = ks_synth_apply_panpot_funcs[synth->lfo_panpot_enabled != 0];
+    plan->panpot_lfo_index = synth->lfo_panpot_enabled;
+
+    bool fusable = synth->lfo_filter_enabled == 0 && plan->num_lfos == 0;
+    for(unsigned i=0; i<plan->num_operators; i++){
+        const ks_synth_operator_stage* stage = &plan->operators[i];
+        if(i == 0){
+            fusable = fusable && synth->operators[0].wave_table != ctx->wave_tables[KS_WAVE_NOISE];
+        } else {
+            fusable = fusable && !synth->mods[stage->op - 1].sync;
+        }
+    }
+    for(unsigned m=0; m<2; m++){
+        plan->fused[0][m] = fusable ? ks_synth_render_fused_funcs[plan->num_operators - 1][0][m] : NULL;
+        plan->fused[1][m] = fusable && synth->filter_type < KS_NUM_FILTER_TYPES ? ks_synth_render_fused_funcs[plan->num_operators - 1][1][m] : NULL;
+    }
+}
+
+ks_synth_render_buffer* ks_synth_render_buffer_new(u32 length, u32 lanes){
+    ks_synth_render_buffer* ret = calloc(1, sizeof(ks_synth_render_buffer));
+    const size_t align = KS_RENDER_BUFFER_ALIGN - 1;
+    const size_t stride = (sizeof(i32) * length + align) & ~align;
+    // each lane updates filter coefficients at most once per KS_UPDATE_PER_FRAMES - 1 samples
+    const size_t rows = (length / (KS_UPDATE_PER_FRAMES - 1) + 1) * KS_SYNTH_MAX_LANES + 1;
+    const size_t coefs_size = (sizeof(i32) * KS_SIMD_BIQUAD_ROW * rows + align) & ~align;
+    const size_t starts_size = (sizeof(u32) * (rows + 1) + align) & ~align;
+
+    lanes = MAX(MIN(lanes, KS_SYNTH_MAX_LANES), 1u);
+    ret->length = length;
+    ret->lanes = lanes;
+
+    size_t size = stride * ((KS_NUM_LFOS+1) * lanes + 1);
+    if(lanes > 1){
+        size += stride * 2 + coefs_size + starts_size;
+    }
+    ret->data = malloc(size + KS_RENDER_BUFFER_ALIGN);
+
+    // malloc does not promise more than 16 bytes alignment, so align by hand
+    u8* begin = (u8*)(((uintptr_t)ret->data + align) & ~(uintptr_t)align);
+    for(unsigned l=0; l<lanes; l++){
+        for(unsigned i=0; i<KS_NUM_LFOS+1; i++){
+            ret->bufs[l][i] = (i32*)begin;
+            begin += stride;
+        }
+    }
+    ret->envelope_gains = (i32*)begin;
+    begin += stride;
+    if(lanes > 1){
+        ret->mixbuf = (i32*)begin;
+        ret->filter_coefs = (i32*)(begin + stride * 2);
+        ret->filter_starts = (u32*)(begin + stride * 2 + coefs_size);
+    }
+
+    return ret;
+}
+
+void ks_synth_render_buffer_free(ks_synth_render_buffer* rb){
+    free(rb->data);
+    free(rb);
+}
+
+// LFOs and operators of plan
+static void KS_FORCEINLINE ks_synth_render_stages(const ks_synth_context*ctx, ks_synth_note* note, u32 pitchbend, i32* bufs[], u32 len){
+    const ks_synth_render_plan* plan = &note->synth->plan;
+
+    for(unsigned i=0; i<plan->num_lfos; i++){
+        const u32 l = plan->lfos[i];
+        ks_synth_render_lfo(ctx, note, l, bufs[l+1], len);
+    }
+
+    for(unsigned i=0; i<plan->num_operators; i++){
+        ks_synth_render_operator(ctx, note, &plan->operators[i], pitchbend, bufs, len);
+    }
+}
+
+static void ks_synth_render_piece(const ks_synth_context*ctx, ks_synth_render_buffer* rb, ks_synth_note* note, u32 volume, u32 pitchbend, i32 *buf, u32 tmpbuf_len, bool mono){
+    const ks_synth_render_plan* plan = &note->synth->plan;
+    i32** bufs = rb->bufs[0];
+
+    ks_synth_render_stages(ctx, note, pitchbend, bufs, tmpbuf_len);
+
+    if(!note->filter_bypass && plan->filter != NULL){
+        plan->filter(ctx, note, bufs, tmpbuf_len, plan->filter_lfo_index);
+    }
+    ks_synth_apply_envelope(ctx, rb, note, bufs[0], tmpbuf_len);
+
+    for(unsigned i=0; i<tmpbuf_len; i++){
+        bufs[0][i] = ((i64)bufs[0][i] * volume)>> KS_VOLUME_BITS;
+    }
+
+    if(mono){
+        ks_synth_apply_mono(buf, bufs[0], tmpbuf_len);
     } else {
-        ks_synth_apply_panpot_func(1)(ctx, note, buf, bufs, len, synth->lfo_panpot_enabled);
+        plan->panpot(ctx, note, buf, bufs, tmpbuf_len, plan->panpot_lfo_index);
     }
+    ks_synth_advance_lfos(note, tmpbuf_len);
+}
+
+// NULL if the block is large or the note needs separated stages
+static ks_synth_fused_func ks_synth_note_fused_func(const ks_synth_note* note, u32 frames, bool mono){
+    if(frames > KS_SYNTH_FUSED_MAX_FRAMES) return NULL;
+    return note->synth->plan.fused[!note->filter_bypass][mono];
+}
+
+static void ks_synth_render_voices_add_base(const ks_synth_context*ctx, ks_synth_render_buffer* rb, ks_synth_note* notes[], u32 num_notes, u32 volume, u32 pitchbend, i32 *buf, u32 frames, bool mono);
+
+void ks_synth_render_add(const ks_synth_context*ctx, ks_synth_render_buffer* rb, ks_synth_note* note, u32 volume, u32 pitchbend, i32 *buf, u32 len)
+{
+    if(note->envelopes[0].state == KS_ENVELOPE_OFF) return;
+    ks_synth_render_voices_add_base(ctx, rb, &note, 1, volume, pitchbend, buf, len / 2, false);
+}
+
+void ks_synth_render_buffered(const ks_synth_context*ctx, ks_synth_render_buffer* rb, ks_synth_note* note, u32 volume, u32 pitchbend, i32 *buf, u32 len)
+{
+    memset(buf, 0, len*sizeof(i32));
+    ks_synth_render_add(ctx, rb, note, volume, pitchbend, buf, len);
 }
 
 void ks_synth_render(const ks_synth_context*ctx, ks_synth_note* note, u32 volume, u32 pitchbend, i32 *buf, u32 len)
 {
     if(note->envelopes[0].state != KS_ENVELOPE_OFF){
-        const ks_synth* synth = note->synth;
-        const size_t tmpbuf_len = len / 2;
-
-        i32* bufs[KS_NUM_LFOS+1];
+        ks_synth_render_buffer* rb = ks_synth_render_buffer_new(MIN(MAX(len / 2, 1u), KS_SYNTH_TILE_FRAMES), 1);
+        ks_synth_render_buffered(ctx, rb, note, volume, pitchbend, buf, len);
+        ks_synth_render_buffer_free(rb);
+    } else {
+        memset(buf, 0, len*sizeof(i32));
+    }
+}
 
-        bufs[0] = (i32*)malloc(sizeof(i32) * tmpbuf_len);
+bool ks_synth_note_can_share_lanes(const ks_synth_note* n1, const ks_synth_note* n2){
+    return n1->synth == n2->synth && n1->filter_bypass == n2->filter_bypass;
+}
 
+// same as ks_envelope_process for each samples, without gains
+static void ks_synth_envelope_skip(const ks_synth_context* ctx, ks_synth_note* note, int i, u32 len){
+    ks_synth_note_envelope* envelope = &note->envelopes[i];
 
-        for(unsigned i=0; i<KS_NUM_LFOS; i++){
-            if(synth->lfo_levels[i] != 0){
-                bufs[i+1]= (i32*)malloc(sizeof(i32) * tmpbuf_len);
-                ks_synth_render_lfo(ctx, note, i, bufs[i+1], tmpbuf_len);
-            }
+    while(len != 0 && envelope->state != KS_ENVELOPE_SUSTAINED && envelope->state != KS_ENVELOPE_OFF){
+        u32 run = envelope->update_clock;
+        if(run == 0){
+            ks_calclate_envelope(ctx, note, i);
+            run = KS_UPDATE_PER_FRAMES;
         }
+        run = MIN(run, len);
+        envelope->update_clock = ks_mask(envelope->update_clock - run, KS_UPDATE_PER_FRAMES_BITS);
+        len -= run;
+    }
+    envelope->update_clock = ks_mask(envelope->update_clock - len, KS_UPDATE_PER_FRAMES_BITS);
+}
+
+void ks_synth_note_skip(const ks_synth_context* ctx, ks_synth_note* note, u32 pitchbend, u32 frames){
+    const ks_synth* synth = note->synth;
 
-        ks_synth_render_0(ctx, note, pitchbend, bufs, tmpbuf_len);
-        for(unsigned i=1; i< KS_NUM_OPERATORS; i++){
-            ks_synth_render_branch(ctx, note, i, pitchbend, bufs, tmpbuf_len);
+    ks_synth_envelope_skip(ctx, note, 0, frames);
+    // the filter envelope moves only with the filter
+    if(!note->filter_bypass && synth->plan.filter != NULL){
+        ks_synth_envelope_skip(ctx, note, 1, frames);
+    }
+
+    // the noise table steps every time the phase of operator 0 wraps around, as ks_synth_render_mod_base
+    if(synth->operators[0].wave_table == ctx->wave_tables[KS_WAVE_NOISE]){
+        const u32 delta = ((u64)note->operators[0].phase_delta * pitchbend) >> KS_PITCH_BEND_BITS;
+        for(u64 w = ((u64)note->operators[0].phase + (u64)delta * frames) >> 32; w != 0; w--){
+            note->noise_table_offset = ks_noise_next(note->noise_table_offset);
         }
-        ks_synth_apply_filter(ctx, note, bufs, tmpbuf_len);
-        ks_synth_apply_envelope(ctx, note, bufs[0], tmpbuf_len);
+    }
+
+    for(unsigned i=0; i<KS_NUM_OPERATORS; i++){
+        const u32 delta = ((u64)note->operators[i].phase_delta * pitchbend) >> KS_PITCH_BEND_BITS;
+        note->operators[i].phase += delta * frames;
+    }
+    ks_synth_advance_lfos(note, frames);
+}
+
+bool ks_synth_note_is_silent(const ks_synth_note* note, u32 volume, u32 threshold){
+    const ks_synth_note_envelope* envelope = &note->envelopes[0];
+    if(envelope->state != KS_ENVELOPE_RELEASED) return false;
+
+    // release segment moves to the release point monotonically
+    const i64 amp = MAX(llabs(envelope->now_amp), llabs(note->envelope_setups[0].points[KS_ENVELOPE_RELEASE_INDEX]));
+    return ((amp * volume) >> KS_VOLUME_BITS) < threshold;
+}
+
+// operators run per note, only the biquad filter runs across lanes
+static void ks_synth_render_voices_piece(const ks_synth_context*ctx, ks_synth_render_buffer* rb, ks_synth_note* notes[], u32 num_notes, u32 volume, u32 pitchbend, i32 *buf, u32 tmpbuf_len, bool mono){
+    const ks_synth_render_plan* plan = &notes[0]->synth->plan;
+
+    for(unsigned l=0; l<num_notes; l++){
+        ks_synth_render_stages(ctx, notes[l], pitchbend, rb->bufs[l], tmpbuf_len);
+    }
+
+    if(!notes[0]->filter_bypass && plan->filter_voices != NULL){
+        plan->filter_voices(ctx, rb, notes, num_notes, tmpbuf_len, plan->filter_lfo_index);
+    }
+
+    for(unsigned l=0; l<num_notes; l++){
+        i32** bufs = rb->bufs[l];
+
+        ks_synth_apply_envelope(ctx, rb, notes[l], bufs[0], tmpbuf_len);
 
         for(unsigned i=0; i<tmpbuf_len; i++){
             bufs[0][i] = ((i64)bufs[0][i] * volume)>> KS_VOLUME_BITS;
         }
 
-        ks_synth_apply_panpot_branch(ctx, note, buf, bufs, tmpbuf_len);
-        free(bufs[0]);
-        for(unsigned i=0; i<KS_NUM_LFOS; i++){
-            if(synth->lfo_levels[i] != 0){
-                free(bufs[i+1]);
-            }
+        if(mono){
+            ks_synth_apply_mono(buf, bufs[0], tmpbuf_len);
+        } else {
+            plan->panpot(ctx, notes[l], buf, bufs, tmpbuf_len, plan->panpot_lfo_index);
         }
+        ks_synth_advance_lfos(notes[l], tmpbuf_len);
+    }
+}
 
-    } else {
-        memset(buf, 0, len*sizeof(i32));
+// buf has frames samples if mono, otherwise frames * 2 samples of stereo
+static void ks_synth_render_voices_add_base(const ks_synth_context*ctx, ks_synth_render_buffer* rb, ks_synth_note* notes[], u32 num_notes, u32 volume, u32 pitchbend, i32 *buf, u32 frames, bool mono){
+    // lanes of the buffer are allocated for rb->lanes notes, more notes are rendered in batches of them
+    while(num_notes > rb->lanes){
+        ks_synth_render_voices_add_base(ctx, rb, notes, rb->lanes, volume, pitchbend, buf, frames, mono);
+        notes += rb->lanes;
+        num_notes -= rb->lanes;
+    }
+    if(num_notes == 0) return;
+
+    const ks_synth_fused_func fused = ks_synth_note_fused_func(notes[0], frames, mono);
+    if(fused != NULL){
+        // notes which share lanes have same plan
+        for(unsigned l=0; l<num_notes; l++){
+            fused(ctx, notes[l], volume, pitchbend, buf, frames);
+        }
+        return;
     }
 
+    const u32 channels = mono ? 1 : 2;
+    for(u32 i=0; i<frames; i+= rb->length){
+        const u32 piece = MIN(frames - i, rb->length);
+        if(num_notes == 1){
+            ks_synth_render_piece(ctx, rb, notes[0], volume, pitchbend, buf + i*channels, piece, mono);
+        } else {
+            ks_synth_render_voices_piece(ctx, rb, notes, num_notes, volume, pitchbend, buf + i*channels, piece, mono);
+        }
+    }
 }
 
+void ks_synth_render_voices_add(const ks_synth_context*ctx, ks_synth_render_buffer* rb, ks_synth_note* notes[], u32 num_notes, u32 volume, u32 pitchbend, i32 *buf, u32 len){
+    ks_synth_render_voices_add_base(ctx, rb, notes, num_notes, volume, pitchbend, buf, len / 2, false);
+}
+
+void ks_synth_render_voices_mono_add(const ks_synth_context*ctx, ks_synth_render_buffer* rb, ks_synth_note* notes[], u32 num_notes, u32 volume, u32 pitchbend, i32 *buf, u32 frames){
+    ks_synth_render_voices_add_base(ctx, rb, notes, num_notes, volume, pitchbend, buf, frames, true);
+}
+
+void ks_synth_render_voices(const ks_synth_context*ctx, ks_synth_render_buffer* rb, ks_synth_note* notes[], u32 num_notes, u32 volume, u32 pitchbend, i32 *buf, u32 len){
+    memset(buf, 0, len*sizeof(i32));
+    ks_synth_render_voices_add(ctx, rb, notes, num_notes, volume, pitchbend, buf, len);
+}
+
+void ks_synth_render_notes_add(const ks_synth_context*ctx, ks_synth_render_buffer* rb, ks_synth_note* notes[], u32 num_notes, u32 volume, u32 pitchbend, i32 *buf, u32 len){
+    ks_synth_note* lanes[KS_SYNTH_MAX_LANES];
+    u32 num_lanes = 0;
+
+    for(u32 n=0; n<num_notes; n++){
+        if(!ks_synth_note_is_enabled(notes[n])) continue;
+
+        if(num_lanes != 0 && (num_lanes == rb->lanes || !ks_synth_note_can_share_lanes(lanes[0], notes[n]))){
+            ks_synth_render_voices_add(ctx, rb, lanes, num_lanes, volume, pitchbend, buf, len);
+            num_lanes = 0;
+        }
+        lanes[num_lanes++] = notes[n];
+    }
+
+    if(num_lanes != 0){
+        ks_synth_render_voices_add(ctx, rb, lanes, num_lanes, volume, pitchbend, buf, len);
+    }
+}
@@ -8,7 +8,6 @@
 extern "C" {
 #endif
 
-//#include <xmmintrin.h> perhaps, my implementation is so bad, so I have compiler vectorize automatically. It is faster.
 #include <stdint.h>
 #include <stdbool.h>
 #include <ksio/io.h>
@@ -46,6 +45,7 @@ extern "C" {
 #define KS_PHASE_FINE_BITS              (KS_FREQUENCY_BITS)
 
 #define KS_NUM_OPERATORS                4u
+#define KS_NUM_NOTES                    128u
 #define KS_NUM_ENVELOPES                2u
 #define KS_FILTER_LOG_BITS              1u
 #define KS_FILTER_NUM_LOGS              ks_1(KS_FILTER_LOG_BITS)
@@ -56,15 +56,20 @@ extern "C" {
 
 #define KS_VELOCITY_SENS_BITS           7u
 #define KS_FILTER_Q_BITS                7u
+#define KS_FILTER_NUM_Q                 16u
+// omega0 is clamped to nyquist frequency, it is quantized to an index of sin table
+#define KS_FILTER_NUM_OMEGAS            (ks_1(KS_TABLE_BITS-1) + 1)
 #define KS_MIX_BITS                     7u
 
 #define KS_LFO_DEPTH_BITS               16u
 #define KS_NUM_LFOS                     2u
-#define KS_PITCH_BEND_BITS              KS_LFO_DEPTH_BITS;
+#define KS_PITCH_BEND_BITS              KS_LFO_DEPTH_BITS
 
 #define KS_LEVEL_BITS                   16u
 
 #define KS_PANPOT_BITS                  KS_OUTPUT_BITS
+// pan values in a step of the sin table
+#define KS_PANPOT_LFO_GAINS_SHIFT       (KS_PANPOT_BITS - KS_TABLE_BITS + 2)
 #define KS_VOLUME_BITS                  13u
 
 #define KS_TIME_BITS                    16u
@@ -73,6 +78,24 @@ extern "C" {
 #define KS_UPDATE_PER_FRAMES_BITS       3u
 #define KS_UPDATE_PER_FRAMES            ks_1(KS_UPDATE_PER_FRAMES_BITS)
 
+#define KS_RENDER_BUFFER_ALIGN_BITS     6u
+#define KS_RENDER_BUFFER_ALIGN          ks_1(KS_RENDER_BUFFER_ALIGN_BITS)
+
+// number of notes filtered together in biquad lanes by ks_synth_render_voices.
+// operators, envelopes and panpot are still rendered note by note
+#define KS_SYNTH_MAX_LANES              4u
+
+// frames of gains which the panpot LFO stage keeps on stack
+#define KS_SYNTH_PANPOT_LFO_FRAMES      64u
+
+// long requests are rendered in tiles of this number of frames, so buffers of a voice stay in L1 cache
+#define KS_SYNTH_TILE_FRAMES_BITS       7u
+#define KS_SYNTH_TILE_FRAMES            ks_1(KS_SYNTH_TILE_FRAMES_BITS)
+
+// blocks up to this number of frames are rendered in one fused pass, if the synth allows.
+// Separated stages use vectorized kernels and are faster for longer blocks.
+#define KS_SYNTH_FUSED_MAX_FRAMES       8u
+
 /*
  * @enum ks_envelope_state
  * @brief Current envelope state
@@ -120,15 +143,44 @@ typedef enum ks_wave_t
 }ks_synth_wave_t;
 
 
+/**
+  * @enum ks_simd_t
+  * @brief instruction sets used for rendering
+*/
+typedef enum ks_simd_t{
+    KS_SIMD_NONE,
+    KS_SIMD_SSE2,
+    KS_SIMD_AVX2,
+    KS_SIMD_NEON,
+}ks_simd_t;
+
+
 #define KS_MAX_WAVES                128u
 #define KS_CUSTOM_WAVE_BITS         3u
+// wave tables have one more element, vector gather reads 32 bits at the last one
+#define KS_WAVE_TABLE_LENGTH        (ks_1(KS_TABLE_BITS) + 1)
+
+/**
+ * @struct ks_biquad_coefs
+ * @brief Coefficients of biquad filter divided by a0.
+*/
+typedef struct ks_biquad_coefs{
+    i32         b0a0;
+    i32         b1a0;
+    i32         b2a0;
+    i32         a1a0;
+    i32         a2a0;
+}ks_biquad_coefs;
 
 typedef struct ks_synth_context{
     u32         sampling_rate;
     u32         sampling_rate_inv;
-    u32         note_deltas[128];
-    u16         powerof2[ks_1(KS_TABLE_BITS)]; // 1 ~ 2^4
+    u32         note_deltas[KS_NUM_NOTES];
+    u16         powerof2[ks_1(KS_TABLE_BITS) + 1]; // 1 ~ 2^4
     i16         *(wave_tables[KS_MAX_WAVES]);
+    ks_biquad_coefs *filter_coefs;                  // [filter type][q][omega0 index]
+    i16         panpot_lfo_gains[ks_1(KS_TABLE_BITS)][2];   // [(pan >> KS_PANPOT_LFO_GAINS_SHIFT) & mask][left, right], with sqrt(2) for the center
+    ks_simd_t   simd;
 }ks_synth_context;
 
 
@@ -192,6 +244,13 @@ typedef struct ks_synth_data{
 
 typedef struct ks_synth_note ks_synth_note;
 typedef struct ks_synth     ks_synth;
+typedef struct ks_synth_render_buffer ks_synth_render_buffer;
+
+typedef void (*ks_synth_operator_func)      (ks_synth_note* note, u32 op, u32 pitchbend, i32* buf[], u32 len);
+typedef void (*ks_synth_filter_func)        (const ks_synth_context* ctx, ks_synth_note* note, i32* buf[], u32 len, u32 lfo_index);
+typedef void (*ks_synth_filter_voices_func) (const ks_synth_context* ctx, ks_synth_render_buffer* rb, ks_synth_note* notes[], u32 num_notes, u32 len, u32 lfo_index);
+typedef void (*ks_synth_panpot_func)        (const ks_synth_context* ctx, ks_synth_note* note, i32* buf, i32* bufs[], u32 len, u32 lfo_index);
+typedef void (*ks_synth_fused_func)         (const ks_synth_context* ctx, ks_synth_note* note, u32 volume, u32 pitchbend, i32* buf, u32 len);
 
 
 typedef struct ks_synth_operator{
@@ -234,6 +293,50 @@ typedef struct ks_synth_lfo {
 
 }ks_synth_lfo;
 
+/**
+ * @struct ks_synth_operator_stage
+ * @brief Rendering of an operator, chosen at ks_synth_set.
+*/
+typedef struct ks_synth_operator_stage{
+    ks_synth_operator_func  render;                     // specialized scalar function
+    u8                      op;
+    u8                      mod_type;                   // KS_NUM_MODS for operator 0
+    bool                    simd;                       // vectorized kernels can render it
+    bool                    fm;
+    bool                    ams;
+}ks_synth_operator_stage;
+
+/**
+ * @struct ks_synth_render_plan
+ * @brief Stages to render a note, chosen at ks_synth_set. Rendering walks them without branching on synth parametors.
+*/
+typedef struct ks_synth_render_plan{
+    u8                          num_lfos;
+    u8                          lfos                    [KS_NUM_LFOS];          // LFOs which have level and feed operators or panpot
+    u8                          num_operators;
+    ks_synth_operator_stage     operators               [KS_NUM_OPERATORS];     // operators except of KS_MOD_PASS
+
+    ks_synth_filter_func        filter;                                         // NULL : not applied
+    ks_synth_filter_voices_func filter_voices;
+    u32                         filter_lfo_index;
+
+    ks_synth_panpot_func        panpot;
+    u32                         panpot_lfo_index;
+
+    ks_synth_fused_func         fused                   [2][2];                 // [filter][mono], NULL : stages are always rendered separately
+}ks_synth_render_plan;
+
+/**
+ * @struct ks_synth_key
+ * @brief Parametors of a note number which do not depend on velocity, calculated at ks_synth_set.
+*/
+typedef struct ks_synth_key{
+    u32             phase_deltas                [KS_NUM_OPERATORS];
+    u32             samples                     [KS_NUM_ENVELOPES][KS_ENVELOPE_NUM_POINTS];     // scaled by rate scale
+    i32             deltas                      [KS_NUM_ENVELOPES][KS_ENVELOPE_NUM_POINTS];     // ks_1(KS_ENVELOPE_BITS) / samples
+    u32             filter_cutoff;
+}ks_synth_key;
+
 /**
  * @struct ks_synth_data
  * @brief Synthesizer data read for ease of calculation.
@@ -259,10 +362,15 @@ typedef struct ks_synth
     u8              lfo_panpot_enabled;
 
     u8              filter_type;
+    bool            filter_bypass;              // filter is transparent for all notes, it is not applied
+    const ks_biquad_coefs* filter_coefs;        // coefficients of filter type and q, indexed by omega0, NULL : not filtered
 
 
     const i16*      lfo_wave_tables             [KS_NUM_LFOS];
 
+    ks_synth_render_plan    plan;
+    ks_synth_key            keys                [KS_NUM_NOTES];
+
     bool            enabled;
 }
 ks_synth;
@@ -274,11 +382,6 @@ typedef struct ks_synth_note_operator{
 
 typedef struct ks_synth_note_envelope{
     i32                 level;
-    i32                 points             [KS_ENVELOPE_NUM_POINTS];
-    u32                 samples            [KS_ENVELOPE_NUM_POINTS];
-    i32                 deltas             [KS_ENVELOPE_NUM_POINTS];
-    i32                 diffs              [KS_ENVELOPE_NUM_POINTS];
-
     u32                 now_delta;
     i32                 now_time;
     i32                 now_amp;
@@ -291,21 +394,31 @@ typedef struct ks_synth_note_envelope{
 
 }ks_synth_note_envelope;
 
+// read only when an envelope moves to next point
+typedef struct ks_synth_note_envelope_setup{
+    i32                 points             [KS_ENVELOPE_NUM_POINTS];
+    u32                 samples            [KS_ENVELOPE_NUM_POINTS];
+    i32                 deltas             [KS_ENVELOPE_NUM_POINTS];
+    i32                 diffs              [KS_ENVELOPE_NUM_POINTS];
+}ks_synth_note_envelope_setup;
+
 /**
  * @struct ks_synth_data
- * @brief Note state.
+ * @brief Note state, states updated while rendering come first and setups calculated at note on are at last.
 */
 typedef  struct ks_synth_note
 {
     const ks_synth* synth;
 
     ks_synth_note_operator  operators                   [KS_NUM_OPERATORS];
-    ks_synth_note_envelope  envelopes                   [KS_NUM_ENVELOPES];
+    u32                     lfo_phases                  [KS_NUM_LFOS];
+    u32                     noise_table_offset;         // state of xorshift, never be 0
 
-    i32                     filter_in_logs              [4];
-    i32                     filter_out_logs             [4];
+    i32                     filter_in_logs              [KS_FILTER_NUM_LOGS];
+    i32                     filter_out_logs             [KS_FILTER_NUM_LOGS];
     u32                     filter_seek;
     u32                     filter_cutoff;
+    bool                    filter_bypass;              // synth->filter_bypass or filter is transparent for this note
 
     i32 a1a0;
     i32 a2a0;
@@ -314,11 +427,27 @@ typedef  struct ks_synth_note
     i32 b1a0;
     i32 b2a0;
 
-    u32                     lfo_phases                  [KS_NUM_LFOS];
-    u32                     noise_table_offset;
+    ks_synth_note_envelope  envelopes                   [KS_NUM_ENVELOPES];
+
+    ks_synth_note_envelope_setup envelope_setups        [KS_NUM_ENVELOPES];
 }
 ks_synth_note;
 
+/**
+ * @struct ks_synth_render_buffer
+ * @brief Preallocated temporary buffers for rendering notes.
+*/
+typedef struct ks_synth_render_buffer{
+    u32                     length;
+    u32                     lanes;
+    i32*                    bufs                        [KS_SYNTH_MAX_LANES][KS_NUM_LFOS+1];
+    i32*                    mixbuf;                     // scratch of unused filter lanes
+    i32*                    envelope_gains;
+    i32*                    filter_coefs;
+    u32*                    filter_starts;
+    void*                   data;
+}ks_synth_render_buffer;
+
 ks_io_decl_custom_func(ks_synth_data);
 ks_io_decl_custom_func(ks_envelope_data);
 ks_io_decl_custom_func(ks_envelope_point_data);
@@ -335,10 +464,38 @@ void                        ks_synth_free                   (ks_synth* synth);
 void                        ks_synth_data_set_default       (ks_synth_data* data);
 void                        ks_synth_set                    (ks_synth* synth, const ks_synth_context *ctx, const ks_synth_data* data);
 void                        ks_synth_render                 (const ks_synth_context*ctx, ks_synth_note* note, u32 volume, u32 pitchbend, i32 *buf, u32 len);
+void                        ks_synth_render_buffered        (const ks_synth_context*ctx, ks_synth_render_buffer* rb, ks_synth_note* note, u32 volume, u32 pitchbend, i32 *buf, u32 len);
+// renders sum of notes, they must be enabled and able to share lanes each other.
+// operators are rendered note by note, and then rb->lanes notes at most are filtered together in lanes,
+// more notes are rendered in batches of rb->lanes
+void                        ks_synth_render_voices          (const ks_synth_context*ctx, ks_synth_render_buffer* rb, ks_synth_note* notes[], u32 num_notes, u32 volume, u32 pitchbend, i32 *buf, u32 len);
+// *_add functions mix notes into stereo buf instead of overwriting it, volume is the gain in KS_VOLUME_BITS
+void                        ks_synth_render_add             (const ks_synth_context*ctx, ks_synth_render_buffer* rb, ks_synth_note* note, u32 volume, u32 pitchbend, i32 *buf, u32 len);
+void                        ks_synth_render_voices_add      (const ks_synth_context*ctx, ks_synth_render_buffer* rb, ks_synth_note* notes[], u32 num_notes, u32 volume, u32 pitchbend, i32 *buf, u32 len);
+// mixes notes into mono buf of frames samples without the panpot of the synth, for synths without panpot LFO.
+// caller pans the sum with ks_synth_panpot_gains
+void                        ks_synth_render_voices_mono_add (const ks_synth_context*ctx, ks_synth_render_buffer* rb, ks_synth_note* notes[], u32 num_notes, u32 volume, u32 pitchbend, i32 *buf, u32 frames);
+// any notes, disabled notes are skipped, consecutive notes which can share lanes are filtered together
+void                        ks_synth_render_notes_add       (const ks_synth_context*ctx, ks_synth_render_buffer* rb, ks_synth_note* notes[], u32 num_notes, u32 volume, u32 pitchbend, i32 *buf, u32 len);
 void                        ks_synth_note_on                (ks_synth_note* note, const ks_synth *synth, const ks_synth_context* ctx,  u8 notenum, u8 velocity);
 void                        ks_synth_note_off               (ks_synth_note* note);
+// note on over a sounding note, envelopes start from their current levels instead of 0
+void                        ks_synth_note_retrigger         (ks_synth_note* note, const ks_synth *synth, const ks_synth_context* ctx,  u8 notenum, u8 velocity);
+// note off with the release of frames at most
+void                        ks_synth_note_choke             (ks_synth_note* note, u32 frames);
 bool                        ks_synth_note_is_enabled        (const ks_synth_note* note);
 bool                        ks_synth_note_is_on             (const ks_synth_note* note);
+bool                        ks_synth_note_can_share_lanes   (const ks_synth_note* n1, const ks_synth_note* n2);
+// advances a note by frames without output, at control rate. Envelopes, phases of operators and LFOs move as rendered,
+// modulations of phases are ignored. The note can be rendered again from there.
+void                        ks_synth_note_skip              (const ks_synth_context* ctx, ks_synth_note* note, u32 pitchbend, u32 frames);
+// true if the note is released and its gain, envelope level * volume in KS_ENVELOPE_BITS, stays under threshold
+bool                        ks_synth_note_is_silent         (const ks_synth_note* note, u32 volume, u32 threshold);
+
+// length : number of frames rendered at once, longer requests are rendered in pieces
+// lanes : maximum number of notes filtered together by ks_synth_render_voices, 1 to KS_SYNTH_MAX_LANES
+ks_synth_render_buffer*     ks_synth_render_buffer_new      (u32 length, u32 lanes);
+void                        ks_synth_render_buffer_free     (ks_synth_render_buffer* rb);
 
 // ((1<<v_bits) + v) << (e-1)
 // max : (1<<v_bits) << (1<<e_bits)
@@ -354,6 +511,8 @@ u32                         ks_fms_depth                    (i32 depth);
 
 void                        ks_calc_panpot                  (const ks_synth_context *ctx, i16* left, i16* right, u32 val);
 i32                         ks_apply_panpot                 (i32 in, i16 pan);
+// gains of the synth panpot, a voice in stereo is ks_apply_panpot(in, gain) >> 1
+void                        ks_synth_panpot_gains           (const ks_synth_context *ctx, const ks_synth* synth, i16* left, i16* right);
 
 #define ks_linear_i         (i32)ks_linear
 #define ks_linear_u         (u32)ks_linear
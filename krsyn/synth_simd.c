@@ -0,0 +1,725 @@
+#include "synth_simd.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define KS_SIMD_USE_SSE2
+#include <emmintrin.h>
+#endif
+#endif
+
+#if defined(KS_SIMD_USE_SSE2) && (defined(__GNUC__) || defined(_MSC_VER))
+#define KS_SIMD_USE_AVX2
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define KS_TARGET_AVX2
+#else
+#define KS_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define KS_SIMD_USE_NEON
+#include <arm_neon.h>
+#endif
+
+#ifdef __TINYC__
+#undef KS_SIMD_USE_SSE2
+#undef KS_SIMD_USE_AVX2
+#undef KS_SIMD_USE_NEON
+#endif
+
+#ifdef KS_SIMD_USE_AVX2
+static bool ks_cpu_has_avx2(void){
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if(info[0] < 7) return false;
+    __cpuid(info, 1);
+    // OSXSAVE and AVX
+    if((info[2] & (ks_1(27) | ks_1(28))) != (ks_1(27) | ks_1(28))) return false;
+    // OS saves xmm and ymm registers
+    if((_xgetbv(0) & 6) != 6) return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & ks_1(5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+ks_simd_t ks_simd_detect(void){
+#ifdef KS_SIMD_USE_AVX2
+    if(ks_cpu_has_avx2()) return KS_SIMD_AVX2;
+#endif
+#if defined(KS_SIMD_USE_SSE2)
+    return KS_SIMD_SSE2;
+#elif defined(KS_SIMD_USE_NEON)
+    return KS_SIMD_NEON;
+#else
+    return KS_SIMD_NONE;
+#endif
+}
+
+// All kernels are same as ks_synth_render_mod_base in synth.c without sync, fms and noise.
+// Integer overflows wrap around as the scalar code does, so they make exactly same output.
+
+#ifdef KS_SIMD_USE_SSE2
+
+// low 32 bits of products, same as _mm_mullo_epi32 of sse4.1
+KS_FORCEINLINE static __m128i ks_sse2_mullo(__m128i a, __m128i b){
+    const __m128i even = _mm_mul_epu32(a, b);
+    const __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+// (i32)(((i64)a * b) >> shift)
+KS_FORCEINLINE static __m128i ks_sse2_mul_shr(__m128i a, __m128i b, int shift){
+    const __m128i count = _mm_cvtsi32_si128(shift);
+    const __m128i hi = _mm_set_epi32(-1, 0, -1, 0);
+    // sse2 has only unsigned multiply, so subtract (b << 32) if a < 0 and (a << 32) if b < 0
+    const __m128i fix = _mm_add_epi32(_mm_and_si128(_mm_srai_epi32(a, 31), b), _mm_and_si128(_mm_srai_epi32(b, 31), a));
+
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    even = _mm_sub_epi64(even, _mm_slli_epi64(fix, 32));
+    odd = _mm_sub_epi64(odd, _mm_and_si128(fix, hi));
+
+    even = _mm_andnot_si128(hi, _mm_srl_epi64(even, count));
+    odd = _mm_slli_epi64(_mm_srl_epi64(odd, count), 32);
+    return _mm_or_si128(even, odd);
+}
+
+KS_FORCEINLINE static __m128i ks_sse2_lookup(const i16* table, __m128i index){
+    u32 i[4];
+    _mm_storeu_si128((__m128i*)i, index);
+    return _mm_setr_epi32(table[i[0]], table[i[1]], table[i[2]], table[i[3]]);
+}
+
+KS_FORCEINLINE static u32 ks_sse2_render_operator_base(ks_simd_operator* op, i32* buf, const i32* ams_buf, u32 len, u32 mod_type, bool fm, bool ams){
+    const u32 n = len & ~3u;
+    const u32 p = op->phase, d = op->phase_delta;
+
+    const __m128i mask = _mm_set1_epi32(ks_m(KS_TABLE_BITS));
+    const __m128i one = _mm_set1_epi32(ks_1(KS_OUTPUT_BITS));
+    const __m128i delta = _mm_set1_epi32(d * 4);
+    const __m128i fm_level = _mm_set1_epi32(op->fm_level);
+    const __m128i mod_level = _mm_set1_epi32(op->mod_level);
+    const __m128i output_level = _mm_set1_epi32(op->output_level);
+
+    __m128i phase = _mm_setr_epi32(p, p + d, p + 2*d, p + 3*d);
+
+    for(u32 i=0; i<n; i+=4){
+        __m128i in = _mm_setzero_si128();
+        __m128i ph = phase;
+        if(mod_type != KS_NUM_MODS){
+            in = _mm_loadu_si128((const __m128i*)(buf + i));
+        }
+        if(fm){
+            __m128i fm_amount = ks_sse2_mullo(in, fm_level);
+            fm_amount = _mm_slli_epi32(_mm_srli_epi32(fm_amount, KS_LEVEL_BITS - 3), KS_PHASE_MAX_BITS - KS_OUTPUT_BITS);
+            ph = _mm_add_epi32(ph, fm_amount);
+        }
+
+        __m128i out = ks_sse2_lookup(op->wave_table, _mm_and_si128(_mm_srli_epi32(ph, KS_PHASE_BITS), mask));
+
+        switch (mod_type) {
+        case KS_MOD_MUL:
+            out = _mm_srai_epi32(ks_sse2_mullo(out, in), KS_OUTPUT_BITS);
+            break;
+        case KS_MOD_AM:
+            out = _mm_srai_epi32(ks_sse2_mullo(_mm_add_epi32(out, one), in), KS_OUTPUT_BITS+1);
+            break;
+        }
+
+        if(mod_type != KS_NUM_MODS){
+            out = _mm_add_epi32(ks_sse2_mul_shr(in, mod_level, KS_LEVEL_BITS), ks_sse2_mul_shr(out, output_level, KS_LEVEL_BITS));
+        }
+
+        if(ams){
+            const __m128i factor = _mm_add_epi32(one, _mm_loadu_si128((const __m128i*)(ams_buf + i)));
+            out = ks_sse2_mul_shr(out, factor, KS_OUTPUT_BITS);
+        }
+
+        _mm_storeu_si128((__m128i*)(buf + i), out);
+        phase = _mm_add_epi32(phase, delta);
+    }
+
+    op->phase += d * n;
+    return n;
+}
+
+// signed 64 bits products of low 32 bits in each 64 bits element, same as _mm_mul_epi32 of sse4.1
+KS_FORCEINLINE static __m128i ks_sse2_mul_epi32(__m128i a, __m128i b){
+    const __m128i lo = _mm_set_epi32(0, -1, 0, -1);
+    const __m128i fix = _mm_and_si128(_mm_add_epi32(_mm_and_si128(_mm_srai_epi32(a, 31), b), _mm_and_si128(_mm_srai_epi32(b, 31), a)), lo);
+    return _mm_sub_epi64(_mm_mul_epu32(a, b), _mm_slli_epi64(fix, 32));
+}
+
+KS_FORCEINLINE static __m128i ks_sse2_load_lanes(const i32* p){
+    return _mm_unpacklo_epi32(_mm_loadl_epi64((const __m128i*)p), _mm_setzero_si128());
+}
+
+KS_FORCEINLINE static void ks_sse2_store_lanes(i32* p, __m128i v){
+    _mm_storel_epi64((__m128i*)p, _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 1, 2, 0)));
+}
+
+static u32 ks_sse2_apply_gains(i32* buf, const i32* gains, u32 len){
+    const u32 n = len & ~3u;
+    for(u32 i=0; i<n; i+=4){
+        const __m128i v = _mm_loadu_si128((const __m128i*)(buf + i));
+        const __m128i g = _mm_loadu_si128((const __m128i*)(gains + i));
+        _mm_storeu_si128((__m128i*)(buf + i), ks_sse2_mul_shr(v, g, KS_ENVELOPE_BITS));
+    }
+    return n;
+}
+
+// products wrap around in 32 bits as ks_apply_panpot
+static u32 ks_sse2_add_panned(i32* buf, const i32* in, const i32* gains, u32 len){
+    const u32 n = len & ~1u;
+    for(u32 i=0; i<n; i+=2){
+        const __m128i v = _mm_loadl_epi64((const __m128i*)(in + i));
+        const __m128i g = _mm_loadu_si128((const __m128i*)(gains + 2*i));
+        const __m128i out = _mm_srai_epi32(_mm_srai_epi32(ks_sse2_mullo(_mm_unpacklo_epi32(v, v), g), KS_OUTPUT_BITS), 1);
+        _mm_storeu_si128((__m128i*)(buf + 2*i), _mm_add_epi32(_mm_loadu_si128((const __m128i*)(buf + 2*i)), out));
+    }
+    return n;
+}
+
+// lanes 0 and 1 are in lo, lanes 2 and 3 are in hi
+static void ks_sse2_biquad_voices(ks_simd_biquad* f, const i32* coefs, const u32* starts, i32* bufs[], u32 len){
+    __m128i in1[2], in2[2], out1[2], out2[2], c[KS_SIMD_BIQUAD_COEFS][2];
+
+    for(unsigned h=0; h<2; h++){
+        in1[h] = ks_sse2_load_lanes(f->in1 + 2*h);
+        in2[h] = ks_sse2_load_lanes(f->in2 + 2*h);
+        out1[h] = ks_sse2_load_lanes(f->out1 + 2*h);
+        out2[h] = ks_sse2_load_lanes(f->out2 + 2*h);
+    }
+
+    const i32* row = coefs;
+    for(unsigned k=0; k<KS_SIMD_BIQUAD_COEFS; k++){
+        c[k][0] = ks_sse2_load_lanes(row + k*KS_SYNTH_MAX_LANES);
+        c[k][1] = ks_sse2_load_lanes(row + k*KS_SYNTH_MAX_LANES + 2);
+    }
+
+    for(u32 i=0; i<len; i++){
+        if(i == starts[1]){
+            row += KS_SIMD_BIQUAD_ROW;
+            starts++;
+            for(unsigned k=0; k<KS_SIMD_BIQUAD_COEFS; k++){
+                c[k][0] = ks_sse2_load_lanes(row + k*KS_SYNTH_MAX_LANES);
+                c[k][1] = ks_sse2_load_lanes(row + k*KS_SYNTH_MAX_LANES + 2);
+            }
+        }
+
+        for(unsigned h=0; h<2; h++){
+            const __m128i in0 = _mm_setr_epi32(bufs[2*h][i], 0, bufs[2*h+1][i], 0);
+
+            __m128i acc = _mm_add_epi64(ks_sse2_mul_epi32(c[0][h], in0), ks_sse2_mul_epi32(c[1][h], in1[h]));
+            acc = _mm_add_epi64(acc, ks_sse2_mul_epi32(c[2][h], in2[h]));
+            acc = _mm_sub_epi64(acc, ks_sse2_mul_epi32(c[3][h], out1[h]));
+            acc = _mm_sub_epi64(acc, ks_sse2_mul_epi32(c[4][h], out2[h]));
+
+            // only low 32 bits are used, so logical shift is enough
+            const __m128i out = _mm_srli_epi64(acc, KS_OUTPUT_BITS);
+            bufs[2*h][i] = _mm_cvtsi128_si32(out);
+            bufs[2*h+1][i] = _mm_cvtsi128_si32(_mm_srli_si128(out, 8));
+
+            in2[h] = in1[h];
+            in1[h] = in0;
+            out2[h] = out1[h];
+            out1[h] = out;
+        }
+    }
+
+    for(unsigned h=0; h<2; h++){
+        ks_sse2_store_lanes(f->in1 + 2*h, in1[h]);
+        ks_sse2_store_lanes(f->in2 + 2*h, in2[h]);
+        ks_sse2_store_lanes(f->out1 + 2*h, out1[h]);
+        ks_sse2_store_lanes(f->out2 + 2*h, out2[h]);
+    }
+}
+
+#endif
+
+#ifdef KS_SIMD_USE_AVX2
+
+KS_FORCEINLINE KS_TARGET_AVX2 static __m256i ks_avx2_mul_shr(__m256i a, __m256i b, int shift){
+    const __m128i count = _mm_cvtsi32_si128(shift);
+    const __m256i even = _mm256_srl_epi64(_mm256_mul_epi32(a, b), count);
+    const __m256i odd = _mm256_srl_epi64(_mm256_mul_epi32(_mm256_srli_epi64(a, 32), _mm256_srli_epi64(b, 32)), count);
+    return _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0xaa);
+}
+
+// wave tables have a padding element, so reading 32 bits at the last element is safe
+KS_FORCEINLINE KS_TARGET_AVX2 static __m256i ks_avx2_lookup(const i16* table, __m256i index){
+    const __m256i v = _mm256_i32gather_epi32((const int*)table, index, 2);
+    return _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16);
+}
+
+KS_FORCEINLINE KS_TARGET_AVX2 static u32 ks_avx2_render_operator_base(ks_simd_operator* op, i32* buf, const i32* ams_buf, u32 len, u32 mod_type, bool fm, bool ams){
+    const u32 n = len & ~7u;
+    const u32 p = op->phase, d = op->phase_delta;
+
+    const __m256i mask = _mm256_set1_epi32(ks_m(KS_TABLE_BITS));
+    const __m256i one = _mm256_set1_epi32(ks_1(KS_OUTPUT_BITS));
+    const __m256i delta = _mm256_set1_epi32(d * 8);
+    const __m256i fm_level = _mm256_set1_epi32(op->fm_level);
+    const __m256i mod_level = _mm256_set1_epi32(op->mod_level);
+    const __m256i output_level = _mm256_set1_epi32(op->output_level);
+
+    __m256i phase = _mm256_setr_epi32(p, p + d, p + 2*d, p + 3*d, p + 4*d, p + 5*d, p + 6*d, p + 7*d);
+
+    for(u32 i=0; i<n; i+=8){
+        __m256i in = _mm256_setzero_si256();
+        __m256i ph = phase;
+        if(mod_type != KS_NUM_MODS){
+            in = _mm256_loadu_si256((const __m256i*)(buf + i));
+        }
+        if(fm){
+            __m256i fm_amount = _mm256_mullo_epi32(in, fm_level);
+            fm_amount = _mm256_slli_epi32(_mm256_srli_epi32(fm_amount, KS_LEVEL_BITS - 3), KS_PHASE_MAX_BITS - KS_OUTPUT_BITS);
+            ph = _mm256_add_epi32(ph, fm_amount);
+        }
+
+        __m256i out = ks_avx2_lookup(op->wave_table, _mm256_and_si256(_mm256_srli_epi32(ph, KS_PHASE_BITS), mask));
+
+        switch (mod_type) {
+        case KS_MOD_MUL:
+            out = _mm256_srai_epi32(_mm256_mullo_epi32(out, in), KS_OUTPUT_BITS);
+            break;
+        case KS_MOD_AM:
+            out = _mm256_srai_epi32(_mm256_mullo_epi32(_mm256_add_epi32(out, one), in), KS_OUTPUT_BITS+1);
+            break;
+        }
+
+        if(mod_type != KS_NUM_MODS){
+            out = _mm256_add_epi32(ks_avx2_mul_shr(in, mod_level, KS_LEVEL_BITS), ks_avx2_mul_shr(out, output_level, KS_LEVEL_BITS));
+        }
+
+        if(ams){
+            const __m256i factor = _mm256_add_epi32(one, _mm256_loadu_si256((const __m256i*)(ams_buf + i)));
+            out = ks_avx2_mul_shr(out, factor, KS_OUTPUT_BITS);
+        }
+
+        _mm256_storeu_si256((__m256i*)(buf + i), out);
+        phase = _mm256_add_epi32(phase, delta);
+    }
+
+    op->phase += d * n;
+    return n;
+}
+
+KS_FORCEINLINE KS_TARGET_AVX2 static __m256i ks_avx2_load_lanes(const i32* p){
+    return _mm256_cvtepi32_epi64(_mm_loadu_si128((const __m128i*)p));
+}
+
+KS_FORCEINLINE KS_TARGET_AVX2 static void ks_avx2_store_lanes(i32* p, __m256i v){
+    p[0] = _mm256_extract_epi32(v, 0);
+    p[1] = _mm256_extract_epi32(v, 2);
+    p[2] = _mm256_extract_epi32(v, 4);
+    p[3] = _mm256_extract_epi32(v, 6);
+}
+
+// a lane is a 64 bits element
+static KS_TARGET_AVX2 u32 ks_avx2_apply_gains(i32* buf, const i32* gains, u32 len){
+    const u32 n = len & ~7u;
+    for(u32 i=0; i<n; i+=8){
+        const __m256i v = _mm256_loadu_si256((const __m256i*)(buf + i));
+        const __m256i g = _mm256_loadu_si256((const __m256i*)(gains + i));
+        _mm256_storeu_si256((__m256i*)(buf + i), ks_avx2_mul_shr(v, g, KS_ENVELOPE_BITS));
+    }
+    return n;
+}
+
+static KS_TARGET_AVX2 u32 ks_avx2_add_panned(i32* buf, const i32* in, const i32* gains, u32 len){
+    const u32 n = len & ~3u;
+    const __m256i dup = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+    for(u32 i=0; i<n; i+=4){
+        const __m256i v = _mm256_permutevar8x32_epi32(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(in + i))), dup);
+        const __m256i g = _mm256_loadu_si256((const __m256i*)(gains + 2*i));
+        const __m256i out = _mm256_srai_epi32(_mm256_srai_epi32(_mm256_mullo_epi32(v, g), KS_OUTPUT_BITS), 1);
+        _mm256_storeu_si256((__m256i*)(buf + 2*i), _mm256_add_epi32(_mm256_loadu_si256((const __m256i*)(buf + 2*i)), out));
+    }
+    return n;
+}
+
+static KS_TARGET_AVX2 void ks_avx2_biquad_voices(ks_simd_biquad* f, const i32* coefs, const u32* starts, i32* bufs[], u32 len){
+    __m256i in1 = ks_avx2_load_lanes(f->in1);
+    __m256i in2 = ks_avx2_load_lanes(f->in2);
+    __m256i out1 = ks_avx2_load_lanes(f->out1);
+    __m256i out2 = ks_avx2_load_lanes(f->out2);
+    __m256i c[KS_SIMD_BIQUAD_COEFS];
+    const i32* row = coefs;
+    for(unsigned k=0; k<KS_SIMD_BIQUAD_COEFS; k++){
+        c[k] = ks_avx2_load_lanes(row + k*KS_SYNTH_MAX_LANES);
+    }
+
+    for(u32 i=0; i<len; i++){
+        if(i == starts[1]){
+            row += KS_SIMD_BIQUAD_ROW;
+            starts++;
+            for(unsigned k=0; k<KS_SIMD_BIQUAD_COEFS; k++){
+                c[k] = ks_avx2_load_lanes(row + k*KS_SYNTH_MAX_LANES);
+            }
+        }
+
+        const __m256i in0 = _mm256_setr_epi32(bufs[0][i], 0, bufs[1][i], 0, bufs[2][i], 0, bufs[3][i], 0);
+
+        __m256i acc = _mm256_add_epi64(_mm256_mul_epi32(c[0], in0), _mm256_mul_epi32(c[1], in1));
+        acc = _mm256_add_epi64(acc, _mm256_mul_epi32(c[2], in2));
+        acc = _mm256_sub_epi64(acc, _mm256_mul_epi32(c[3], out1));
+        acc = _mm256_sub_epi64(acc, _mm256_mul_epi32(c[4], out2));
+
+        // only low 32 bits are used, so logical shift is enough
+        const __m256i out = _mm256_srli_epi64(acc, KS_OUTPUT_BITS);
+        bufs[0][i] = _mm256_extract_epi32(out, 0);
+        bufs[1][i] = _mm256_extract_epi32(out, 2);
+        bufs[2][i] = _mm256_extract_epi32(out, 4);
+        bufs[3][i] = _mm256_extract_epi32(out, 6);
+
+        in2 = in1;
+        in1 = in0;
+        out2 = out1;
+        out1 = out;
+    }
+
+    ks_avx2_store_lanes(f->in1, in1);
+    ks_avx2_store_lanes(f->in2, in2);
+    ks_avx2_store_lanes(f->out1, out1);
+    ks_avx2_store_lanes(f->out2, out2);
+}
+
+#endif
+
+#ifdef KS_SIMD_USE_NEON
+
+KS_FORCEINLINE static int32x4_t ks_neon_mul_shr(int32x4_t a, int32x4_t b, int shift){
+    const int64x2_t count = vdupq_n_s64(-shift);
+    const int64x2_t lo = vshlq_s64(vmull_s32(vget_low_s32(a), vget_low_s32(b)), count);
+    const int64x2_t hi = vshlq_s64(vmull_s32(vget_high_s32(a), vget_high_s32(b)), count);
+    return vcombine_s32(vmovn_s64(lo), vmovn_s64(hi));
+}
+
+KS_FORCEINLINE static int32x4_t ks_neon_lookup(const i16* table, uint32x4_t index){
+    u32 i[4];
+    vst1q_u32(i, index);
+    const i32 v[4] = { table[i[0]], table[i[1]], table[i[2]], table[i[3]] };
+    return vld1q_s32(v);
+}
+
+KS_FORCEINLINE static u32 ks_neon_render_operator_base(ks_simd_operator* op, i32* buf, const i32* ams_buf, u32 len, u32 mod_type, bool fm, bool ams){
+    const u32 n = len & ~3u;
+    const u32 p = op->phase, d = op->phase_delta;
+
+    const uint32x4_t mask = vdupq_n_u32(ks_m(KS_TABLE_BITS));
+    const int32x4_t one = vdupq_n_s32(ks_1(KS_OUTPUT_BITS));
+    const uint32x4_t delta = vdupq_n_u32(d * 4);
+    const int32x4_t fm_level = vdupq_n_s32(op->fm_level);
+    const int32x4_t mod_level = vdupq_n_s32(op->mod_level);
+    const int32x4_t output_level = vdupq_n_s32(op->output_level);
+
+    const u32 init[4] = { p, p + d, p + 2*d, p + 3*d };
+    uint32x4_t phase = vld1q_u32(init);
+
+    for(u32 i=0; i<n; i+=4){
+        int32x4_t in = vdupq_n_s32(0);
+        uint32x4_t ph = phase;
+        if(mod_type != KS_NUM_MODS){
+            in = vld1q_s32(buf + i);
+        }
+        if(fm){
+            uint32x4_t fm_amount = vreinterpretq_u32_s32(vmulq_s32(in, fm_level));
+            fm_amount = vshlq_n_u32(vshrq_n_u32(fm_amount, KS_LEVEL_BITS - 3), KS_PHASE_MAX_BITS - KS_OUTPUT_BITS);
+            ph = vaddq_u32(ph, fm_amount);
+        }
+
+        int32x4_t out = ks_neon_lookup(op->wave_table, vandq_u32(vshrq_n_u32(ph, KS_PHASE_BITS), mask));
+
+        switch (mod_type) {
+        case KS_MOD_MUL:
+            out = vshrq_n_s32(vmulq_s32(out, in), KS_OUTPUT_BITS);
+            break;
+        case KS_MOD_AM:
+            out = vshrq_n_s32(vmulq_s32(vaddq_s32(out, one), in), KS_OUTPUT_BITS+1);
+            break;
+        }
+
+        if(mod_type != KS_NUM_MODS){
+            out = vaddq_s32(ks_neon_mul_shr(in, mod_level, KS_LEVEL_BITS), ks_neon_mul_shr(out, output_level, KS_LEVEL_BITS));
+        }
+
+        if(ams){
+            const int32x4_t factor = vaddq_s32(one, vld1q_s32(ams_buf + i));
+            out = ks_neon_mul_shr(out, factor, KS_OUTPUT_BITS);
+        }
+
+        vst1q_s32(buf + i, out);
+        phase = vaddq_u32(phase, delta);
+    }
+
+    op->phase += d * n;
+    return n;
+}
+
+static u32 ks_neon_apply_gains(i32* buf, const i32* gains, u32 len){
+    const u32 n = len & ~3u;
+    for(u32 i=0; i<n; i+=4){
+        vst1q_s32(buf + i, ks_neon_mul_shr(vld1q_s32(buf + i), vld1q_s32(gains + i), KS_ENVELOPE_BITS));
+    }
+    return n;
+}
+
+static u32 ks_neon_add_panned(i32* buf, const i32* in, const i32* gains, u32 len){
+    const u32 n = len & ~1u;
+    for(u32 i=0; i<n; i+=2){
+        const int32x2_t v = vld1_s32(in + i);
+        const int32x4_t dup = vcombine_s32(vdup_lane_s32(v, 0), vdup_lane_s32(v, 1));
+        const int32x4_t out = vshrq_n_s32(vshrq_n_s32(vmulq_s32(dup, vld1q_s32(gains + 2*i)), KS_OUTPUT_BITS), 1);
+        vst1q_s32(buf + 2*i, vaddq_s32(vld1q_s32(buf + 2*i), out));
+    }
+    return n;
+}
+
+static void ks_neon_biquad_voices(ks_simd_biquad* f, const i32* coefs, const u32* starts, i32* bufs[], u32 len){
+    int32x4_t in1 = vld1q_s32(f->in1);
+    int32x4_t in2 = vld1q_s32(f->in2);
+    int32x4_t out1 = vld1q_s32(f->out1);
+    int32x4_t out2 = vld1q_s32(f->out2);
+    int32x4_t c[KS_SIMD_BIQUAD_COEFS];
+    const i32* row = coefs;
+    for(unsigned k=0; k<KS_SIMD_BIQUAD_COEFS; k++){
+        c[k] = vld1q_s32(row + k*KS_SYNTH_MAX_LANES);
+    }
+
+    for(u32 i=0; i<len; i++){
+        if(i == starts[1]){
+            row += KS_SIMD_BIQUAD_ROW;
+            starts++;
+            for(unsigned k=0; k<KS_SIMD_BIQUAD_COEFS; k++){
+                c[k] = vld1q_s32(row + k*KS_SYNTH_MAX_LANES);
+            }
+        }
+
+        const i32 v[4] = { bufs[0][i], bufs[1][i], bufs[2][i], bufs[3][i] };
+        const int32x4_t in0 = vld1q_s32(v);
+
+        int64x2_t lo = vmull_s32(vget_low_s32(c[0]), vget_low_s32(in0));
+        int64x2_t hi = vmull_s32(vget_high_s32(c[0]), vget_high_s32(in0));
+        lo = vmlal_s32(lo, vget_low_s32(c[1]), vget_low_s32(in1));
+        hi = vmlal_s32(hi, vget_high_s32(c[1]), vget_high_s32(in1));
+        lo = vmlal_s32(lo, vget_low_s32(c[2]), vget_low_s32(in2));
+        hi = vmlal_s32(hi, vget_high_s32(c[2]), vget_high_s32(in2));
+        lo = vmlsl_s32(lo, vget_low_s32(c[3]), vget_low_s32(out1));
+        hi = vmlsl_s32(hi, vget_high_s32(c[3]), vget_high_s32(out1));
+        lo = vmlsl_s32(lo, vget_low_s32(c[4]), vget_low_s32(out2));
+        hi = vmlsl_s32(hi, vget_high_s32(c[4]), vget_high_s32(out2));
+
+        const int32x4_t out = vcombine_s32(vshrn_n_s64(lo, KS_OUTPUT_BITS), vshrn_n_s64(hi, KS_OUTPUT_BITS));
+        bufs[0][i] = vgetq_lane_s32(out, 0);
+        bufs[1][i] = vgetq_lane_s32(out, 1);
+        bufs[2][i] = vgetq_lane_s32(out, 2);
+        bufs[3][i] = vgetq_lane_s32(out, 3);
+
+        in2 = in1;
+        in1 = in0;
+        out2 = out1;
+        out1 = out;
+    }
+
+    vst1q_s32(f->in1, in1);
+    vst1q_s32(f->in2, in2);
+    vst1q_s32(f->out1, out1);
+    vst1q_s32(f->out2, out2);
+}
+
+#endif
+
+static void ks_apply_gains(i32* buf, const i32* gains, u32 len){
+    for(u32 i=0; i<len; i++){
+        buf[i] = ((i64)buf[i] * gains[i]) >> KS_ENVELOPE_BITS;
+    }
+}
+
+static void ks_biquad_voices(ks_simd_biquad* f, const i32* coefs, const u32* starts, i32* bufs[], u32 len){
+    for(unsigned l=0; l<KS_SYNTH_MAX_LANES; l++){
+        const i32* row = coefs + l;
+        const u32* next = starts + 1;
+
+        for(u32 i=0; i<len; i++){
+            if(i == *next){
+                row += KS_SIMD_BIQUAD_ROW;
+                next++;
+            }
+
+            const i64 in0f = (i64)row[0] * bufs[l][i];
+            const i64 in1f = (i64)row[KS_SYNTH_MAX_LANES] * f->in1[l];
+            const i64 in2f = (i64)row[2*KS_SYNTH_MAX_LANES] * f->in2[l];
+            const i64 out1f = (i64)row[3*KS_SYNTH_MAX_LANES] * f->out1[l];
+            const i64 out2f = (i64)row[4*KS_SYNTH_MAX_LANES] * f->out2[l];
+
+            const i32 out = (in0f + in1f + in2f - out1f - out2f) >> KS_OUTPUT_BITS;
+
+            f->in2[l] = f->in1[l];
+            f->in1[l] = bufs[l][i];
+            f->out2[l] = f->out1[l];
+            f->out1[l] = out;
+            bufs[l][i] = out;
+        }
+    }
+}
+
+void ks_simd_biquad_voices(ks_simd_t simd, ks_simd_biquad* f, const i32* coefs, const u32* starts, i32* bufs[], u32 len){
+    switch (simd) {
+#ifdef KS_SIMD_USE_SSE2
+    case KS_SIMD_SSE2:
+        ks_sse2_biquad_voices(f, coefs, starts, bufs, len);
+        return;
+#endif
+#ifdef KS_SIMD_USE_AVX2
+    case KS_SIMD_AVX2:
+        ks_avx2_biquad_voices(f, coefs, starts, bufs, len);
+        return;
+#endif
+#ifdef KS_SIMD_USE_NEON
+    case KS_SIMD_NEON:
+        ks_neon_biquad_voices(f, coefs, starts, bufs, len);
+        return;
+#endif
+    default:
+        ks_biquad_voices(f, coefs, starts, bufs, len);
+        return;
+    }
+}
+
+void ks_simd_apply_gains(ks_simd_t simd, i32* buf, const i32* gains, u32 len){
+    u32 n = 0;
+    switch (simd) {
+#ifdef KS_SIMD_USE_SSE2
+    case KS_SIMD_SSE2:
+        n = ks_sse2_apply_gains(buf, gains, len);
+        break;
+#endif
+#ifdef KS_SIMD_USE_AVX2
+    case KS_SIMD_AVX2:
+        n = ks_avx2_apply_gains(buf, gains, len);
+        break;
+#endif
+#ifdef KS_SIMD_USE_NEON
+    case KS_SIMD_NEON:
+        n = ks_neon_apply_gains(buf, gains, len);
+        break;
+#endif
+    default:
+        break;
+    }
+    ks_apply_gains(buf + n, gains + n, len - n);
+}
+
+static void ks_add_panned(i32* buf, const i32* in, const i32* gains, u32 len){
+    for(u32 i=0; i<len; i++){
+        buf[2*i] += ((in[i] * gains[2*i]) >> KS_OUTPUT_BITS) >> 1;
+        buf[2*i+1] += ((in[i] * gains[2*i+1]) >> KS_OUTPUT_BITS) >> 1;
+    }
+}
+
+void ks_simd_add_panned(ks_simd_t simd, i32* buf, const i32* in, const i32* gains, u32 len){
+    u32 n = 0;
+    switch (simd) {
+#ifdef KS_SIMD_USE_SSE2
+    case KS_SIMD_SSE2:
+        n = ks_sse2_add_panned(buf, in, gains, len);
+        break;
+#endif
+#ifdef KS_SIMD_USE_AVX2
+    case KS_SIMD_AVX2:
+        n = ks_avx2_add_panned(buf, in, gains, len);
+        break;
+#endif
+#ifdef KS_SIMD_USE_NEON
+    case KS_SIMD_NEON:
+        n = ks_neon_add_panned(buf, in, gains, len);
+        break;
+#endif
+    default:
+        break;
+    }
+    ks_add_panned(buf + 2*n, in + n, gains + 2*n, len - n);
+}
+
+#define ks_simd_render_func(isa, mod, fm, ams) ks_ ## isa ## _render_operator_ ## mod ## _ ## fm ## ams
+
+#define ks_simd_render_impl(isa, target, mod, fm, ams) \
+    static u32 KS_NOINLINE target ks_simd_render_func(isa, mod, fm, ams) (ks_simd_operator* op, i32* buf, const i32* ams_buf, u32 len){ \
+        return ks_ ## isa ## _render_operator_base(op, buf, ams_buf, len, mod, fm, ams); \
+    }
+
+#define ks_simd_render_impl_ams(isa, target, mod, fm) \
+    ks_simd_render_impl(isa, target, mod, fm, 0) \
+    ks_simd_render_impl(isa, target, mod, fm, 1)
+
+#define ks_simd_render_impl_isa(isa, target) \
+    ks_simd_render_impl_ams(isa, target, KS_MOD_MIX, 0) \
+    ks_simd_render_impl_ams(isa, target, KS_MOD_MIX, 1) \
+    ks_simd_render_impl_ams(isa, target, KS_MOD_MUL, 0) \
+    ks_simd_render_impl_ams(isa, target, KS_MOD_MUL, 1) \
+    ks_simd_render_impl_ams(isa, target, KS_MOD_AM, 0) \
+    ks_simd_render_impl_ams(isa, target, KS_MOD_AM, 1) \
+    ks_simd_render_impl_ams(isa, target, KS_NUM_MODS, 0)
+
+#define ks_simd_render_branch(isa) { \
+    if(ams){ \
+        fm_branch(isa, 1); \
+    } else { \
+        fm_branch(isa, 0); \
+    } \
+}
+
+#define fm_branch(isa, ams) \
+    switch (mod_type) { \
+    case KS_MOD_MIX: \
+        return fm ? ks_simd_render_func(isa, KS_MOD_MIX, 1, ams)(op, buf, ams_buf, len) : ks_simd_render_func(isa, KS_MOD_MIX, 0, ams)(op, buf, ams_buf, len); \
+    case KS_MOD_MUL: \
+        return fm ? ks_simd_render_func(isa, KS_MOD_MUL, 1, ams)(op, buf, ams_buf, len) : ks_simd_render_func(isa, KS_MOD_MUL, 0, ams)(op, buf, ams_buf, len); \
+    case KS_MOD_AM: \
+        return fm ? ks_simd_render_func(isa, KS_MOD_AM, 1, ams)(op, buf, ams_buf, len) : ks_simd_render_func(isa, KS_MOD_AM, 0, ams)(op, buf, ams_buf, len); \
+    case KS_NUM_MODS: \
+        return ks_simd_render_func(isa, KS_NUM_MODS, 0, ams)(op, buf, ams_buf, len); \
+    }
+
+#ifdef KS_SIMD_USE_SSE2
+ks_simd_render_impl_isa(sse2, )
+#endif
+#ifdef KS_SIMD_USE_AVX2
+ks_simd_render_impl_isa(avx2, KS_TARGET_AVX2)
+#endif
+#ifdef KS_SIMD_USE_NEON
+ks_simd_render_impl_isa(neon, )
+#endif
+
+u32 ks_simd_render_operator(ks_simd_t simd, ks_simd_operator* op, i32* buf, const i32* ams_buf, u32 len, u32 mod_type, bool fm, bool ams){
+    switch (simd) {
+#ifdef KS_SIMD_USE_SSE2
+    case KS_SIMD_SSE2:
+        ks_simd_render_branch(sse2);
+        break;
+#endif
+#ifdef KS_SIMD_USE_AVX2
+    case KS_SIMD_AVX2:
+        ks_simd_render_branch(avx2);
+        break;
+#endif
+#ifdef KS_SIMD_USE_NEON
+    case KS_SIMD_NEON:
+        ks_simd_render_branch(neon);
+        break;
+#endif
+    default:
+        break;
+    }
+    return 0;
+}
+
+#undef fm_branch
@@ -0,0 +1,61 @@
+/**
+ * @file synth_simd.h
+ * @brief Vectorized operator kernels, used by synth.c
+*/
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "./synth.h"
+
+/**
+ * @struct ks_simd_operator
+ * @brief Operator state for vectorized kernels.
+*/
+typedef struct ks_simd_operator{
+    const i16*      wave_table;
+    u32             phase;
+    u32             phase_delta;
+    u32             fm_level;
+    u32             mod_level;
+    u32             output_level;
+}ks_simd_operator;
+
+/**
+ * @struct ks_simd_biquad
+ * @brief Filter history of voices, one lane per voice.
+*/
+typedef struct ks_simd_biquad{
+    i32             in1                 [KS_SYNTH_MAX_LANES];
+    i32             in2                 [KS_SYNTH_MAX_LANES];
+    i32             out1                [KS_SYNTH_MAX_LANES];
+    i32             out2                [KS_SYNTH_MAX_LANES];
+}ks_simd_biquad;
+
+// b0a0, b1a0, b2a0, a1a0, a2a0 for each lane
+#define KS_SIMD_BIQUAD_COEFS            5u
+#define KS_SIMD_BIQUAD_ROW              (KS_SIMD_BIQUAD_COEFS * KS_SYNTH_MAX_LANES)
+
+ks_simd_t                   ks_simd_detect                  (void);
+
+// mod_type is KS_NUM_MODS for operator 0, it has not any modulator.
+// Samples are rendered up to the multiple of vector width, rest is left to scalar code.
+// returns number of rendered samples, op->phase is advanced by them
+u32                         ks_simd_render_operator         (ks_simd_t simd, ks_simd_operator* op, i32* buf, const i32* ams_buf, u32 len, u32 mod_type, bool fm, bool ams);
+
+// Filters KS_SYNTH_MAX_LANES buffers at once, all of lanes must be valid buffers.
+// coefs are rows of KS_SIMD_BIQUAD_ROW, row r is used from sample starts[r].
+// starts[0] is 0, and the last element must be larger than or equal to len.
+void                        ks_simd_biquad_voices           (ks_simd_t simd, ks_simd_biquad* f, const i32* coefs, const u32* starts, i32* bufs[], u32 len);
+
+// buf[i] = ((i64)buf[i] * gains[i]) >> KS_ENVELOPE_BITS
+void                        ks_simd_apply_gains             (ks_simd_t simd, i32* buf, const i32* gains, u32 len);
+
+// buf[2*i+c] += ((in[i] * gains[2*i+c]) >> KS_OUTPUT_BITS) >> 1 for c = left, right, len is number of frames
+void                        ks_simd_add_panned              (ks_simd_t simd, i32* buf, const i32* in, const i32* gains, u32 len);
+
+#ifdef __cplusplus
+}
+#endif
@@ -85,14 +85,17 @@ void ks_synth_context_add_custom_wave(ks_synth_context* ctx, const ks_tone_data*
         ks_warning("Already set wave table %d, table is overrided", ks_wave_index(1, index));
         free(ctx->wave_tables[ks_wave_index(1, index)]);
     }
-    i16* table = ctx->wave_tables[ks_wave_index(1, index)] = malloc(sizeof(i16) * ks_1(KS_TABLE_BITS));
+    i16* table = ctx->wave_tables[ks_wave_index(1, index)] = malloc(sizeof(i16) * KS_WAVE_TABLE_LENGTH);
     i32 tmp[ks_v(2, KS_TABLE_BITS)];
 
     // render and write to table
-    ks_synth_render(ctx, &note, ks_1(KS_VOLUME_BITS), ks_1(KS_LFO_DEPTH_BITS), tmp, ks_v(2, KS_TABLE_BITS));
+    ks_synth_render_buffer* rb = ks_synth_render_buffer_new(KS_SYNTH_TILE_FRAMES, 1);
+    ks_synth_render_buffered(ctx, rb, &note, ks_1(KS_VOLUME_BITS), ks_1(KS_LFO_DEPTH_BITS), tmp, ks_v(2, KS_TABLE_BITS));
+    ks_synth_render_buffer_free(rb);
     for(unsigned i=0 ;i< ks_1(KS_TABLE_BITS); i++){
          table[i] = MIN(MAX((tmp[2*i]) << 2, INT16_MIN), INT16_MAX);
     }
+    table[ks_1(KS_TABLE_BITS)] = table[0];
 }
 
 ks_tone_list* ks_tone_list_new_from_data(ks_synth_context* ctx, const ks_tone_list_data* bin){
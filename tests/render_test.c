@@ -0,0 +1,320 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "../krsyn.h"
+
+#define SAMPLING_RATE   48000
+#define NUM_EVENTS      2048
+#define RENDER_LENGTH   (4096*2)
+#define NOTE_LENGTH     (4096*4)
+
+static const ks_tone_list_data tone_list =
+        #include "../tools/test_tones/test.kstc"
+;
+
+static ks_score_event test_event(u32 delta, u8 status, u8 data0, u8 data1){
+    ks_score_event ret = { .delta = delta, .status = status };
+    ret.data[0] = data0;
+    ret.data[1] = data1;
+    return ret;
+}
+
+// dense score of several programs and percussion, with pitch bend and panpot, fixed by the seed
+static ks_score_data* test_score_new(void){
+    ks_score_event* events = malloc(sizeof(ks_score_event) * NUM_EVENTS);
+    u32 n = 0;
+    events[n++] = test_event(0, 0xff, 0x51, 128);
+    events[n++] = test_event(0, 0xc1, 32, 0);
+    events[n++] = test_event(0, 0xc2, 92, 0);
+    events[n++] = test_event(0, 0xc3, 101, 0);
+    events[n++] = test_event(0, 0xb1, 0x0a, 20);
+    events[n++] = test_event(0, 0xb2, 0x0a, 100);
+    events[n++] = test_event(0, 0xe3, 0x00, 0x50);
+
+    u8 on[KS_NUM_CHANNELS][KS_NUM_NOTES] = {{0}};
+    u32 seed = 1;
+    while(n < NUM_EVENTS - 1){
+        seed = seed * 1103515245u + 12345u;
+        const u32 r = seed >> 8;
+        const u8 ch = r % 5 == 4 ? 9 : r % 5;
+        const u8 note = ch == 9 ? (u8[]){49, 46, 42, 38, 36}[(r >> 4) % 5] : 36 + (r >> 4) % 48;
+        const u32 delta = (r >> 12) % 7 == 0 ? (r >> 16) % 24 : 0;
+        if(on[ch][note] && (r >> 20) % 2){
+            events[n++] = test_event(delta, 0x80 | ch, note, 0);
+            on[ch][note] = 0;
+        } else {
+            events[n++] = test_event(delta, 0x90 | ch, note, 40 + (r >> 22) % 80);
+            on[ch][note] = 1;
+        }
+    }
+    events[n++] = test_event(96, 0xff, 0x2f, 0);
+
+    return ks_score_data_new(96, n, events);
+}
+
+// renders whole score, number of samples is set to length.
+// returns NULL if workers are not available
+static i32* test_render(const ks_score_data* score, ks_simd_t simd, u32 num_workers, u32* length){
+    ks_synth_context* ctx = ks_synth_context_new(SAMPLING_RATE);
+    ctx->simd = simd;
+    ks_tone_list* tones = ks_tone_list_new_from_data(ctx, &tone_list);
+    ks_score_state* state = ks_score_state_new(8);
+    ks_score_state_set_default(state, tones, ctx, score->resolution);
+    if(num_workers > 1 && !ks_score_state_set_workers(state, num_workers)){
+        ks_score_state_free(state);
+        ks_tone_list_free(tones);
+        ks_synth_context_free(ctx);
+        return NULL;
+    }
+
+    u32 capacity = RENDER_LENGTH * 64, len = 0;
+    i32* out = malloc(sizeof(i32) * capacity);
+    while(state->passed_tick >= 0){
+        if(len + RENDER_LENGTH > capacity){
+            capacity *= 2;
+            out = realloc(out, sizeof(i32) * capacity);
+        }
+        ks_score_data_render(score, ctx, state, tones, out + len, RENDER_LENGTH);
+        len += RENDER_LENGTH;
+    }
+    *length = len;
+
+    ks_score_state_free(state);
+    ks_tone_list_free(tones);
+    ks_synth_context_free(ctx);
+    return out;
+}
+
+static bool test_equals(const char* name, const i32* expected, u32 expected_length, const i32* actual, u32 actual_length){
+    const bool equals = expected_length == actual_length && memcmp(expected, actual, sizeof(i32) * expected_length) == 0;
+    printf("result: %s is equals scalar single thread render = %s\n", name, equals ? "True" : "False");
+    return equals;
+}
+
+// renders a note of synth in blocks of frames, with note off at the half.
+// mono blocks are summed by ks_synth_render_voices_mono_add
+static i32* test_render_note(const ks_synth_context* ctx, const ks_synth* synth, u8 note_number, u32 frames, bool mono){
+    ks_synth_render_buffer* rb = ks_synth_render_buffer_new(KS_SYNTH_TILE_FRAMES, 1);
+    const u32 channels = mono ? 1 : 2;
+    i32* out = calloc(NOTE_LENGTH * channels, sizeof(i32));
+    ks_synth_note note;
+    ks_synth_note* notes[] = { &note };
+    ks_synth_note_on(&note, synth, ctx, note_number, 100);
+    for(u32 i=0; i<NOTE_LENGTH; i+=frames){
+        if(i == NOTE_LENGTH / 2){
+            ks_synth_note_off(&note);
+        }
+        if(mono){
+            ks_synth_render_voices_mono_add(ctx, rb, notes, 1, ks_1(KS_VOLUME_BITS), ks_1(KS_LFO_DEPTH_BITS), out + i, frames);
+        } else {
+            ks_synth_render_buffered(ctx, rb, &note, ks_1(KS_VOLUME_BITS), ks_1(KS_LFO_DEPTH_BITS), out + i*2, frames*2);
+        }
+    }
+    ks_synth_render_buffer_free(rb);
+    return out;
+}
+
+// blocks up to KS_SYNTH_FUSED_MAX_FRAMES are rendered in a fused pass, it must be same as stages rendered separately
+static bool test_fused(void){
+    ks_synth_context* ctx = ks_synth_context_new(SAMPLING_RATE);
+    ctx->simd = KS_SIMD_NONE;
+    ks_tone_list* tones = ks_tone_list_new_from_data(ctx, &tone_list);
+    bool passed = true;
+    u32 num_fused = 0;
+
+    for(u32 b=0; b<tones->length; b++){
+        const ks_tone_list_bank* bank = &tones->data[b];
+        for(u32 p=0; p<KS_NUM_MAX_PROGRAMS; p++){
+            if(bank->programs[p] == NULL) continue;
+            for(u32 n=0; n<(bank->bank_number.percussion ? KS_NUM_NOTES : 1u); n++){
+                const ks_synth* synth = bank->bank_number.percussion ? &bank->programs[p][n] : bank->programs[p];
+                if(!synth->enabled || synth->plan.fused[0][0] == NULL) continue;
+                num_fused ++;
+
+                ks_synth staged = *synth;
+                memset(staged.plan.fused, 0, sizeof(staged.plan.fused));
+                const u8 note_number = bank->bank_number.percussion ? n : 60;
+                for(u32 mono=0; mono<2; mono++){
+                    for(u32 frames=1; frames<=KS_SYNTH_FUSED_MAX_FRAMES; frames*=2){
+                        i32* expected = test_render_note(ctx, &staged, note_number, frames, mono);
+                        i32* actual = test_render_note(ctx, synth, note_number, frames, mono);
+                        if(memcmp(expected, actual, sizeof(i32) * NOTE_LENGTH * (mono ? 1 : 2)) != 0){
+                            printf("bank %u program %u note %u, %u frames%s\n", b, p, note_number, frames, mono ? " mono" : "");
+                            passed = false;
+                        }
+                        free(expected);
+                        free(actual);
+                    }
+                }
+            }
+        }
+    }
+    printf("result: fused render of %u synths is equals staged render = %s\n", num_fused, passed && num_fused != 0 ? "True" : "False");
+
+    ks_tone_list_free(tones);
+    ks_synth_context_free(ctx);
+    return passed && num_fused != 0;
+}
+
+#define ADD_NOTES       8
+#define ADD_FRAMES      1000
+#define ADD_BLOCKS      8
+
+typedef enum test_add_mode{
+    ADD_RENDER,             // ks_synth_render_buffered of each note, and then added
+    ADD_NOTE,               // ks_synth_render_add of each note
+    ADD_VOICES,             // ks_synth_render_voices_add of notes of each synth
+    ADD_NOTES_ANY,          // ks_synth_render_notes_add of all notes
+}test_add_mode;
+
+// renders notes of 2 synths over a buffer which is not empty, with note off at the half
+static i32* test_render_add(const ks_synth_context* ctx, const ks_synth* synths[2], test_add_mode mode){
+    ks_synth_render_buffer* rb = ks_synth_render_buffer_new(KS_SYNTH_TILE_FRAMES, KS_SYNTH_MAX_LANES);
+    const u32 volume = ks_v(3, KS_VOLUME_BITS - 2);
+    i32* out = malloc(sizeof(i32) * ADD_FRAMES * 2 * ADD_BLOCKS);
+    i32* tmp = malloc(sizeof(i32) * ADD_FRAMES * 2);
+    for(u32 i=0; i<ADD_FRAMES * 2 * ADD_BLOCKS; i++){
+        out[i] = (i32)(i * 2654435761u) >> 20;
+    }
+
+    // 6 notes of the first synth, more than lanes, and then 2 notes of the second synth
+    ks_synth_note notes[ADD_NOTES];
+    ks_synth_note* note_ptrs[ADD_NOTES];
+    for(u32 n=0; n<ADD_NOTES; n++){
+        ks_synth_note_on(&notes[n], synths[n < 6 ? 0 : 1], ctx, 48 + n*5, 60 + n*8);
+        note_ptrs[n] = &notes[n];
+    }
+
+    for(u32 b=0; b<ADD_BLOCKS; b++){
+        i32* buf = out + b * ADD_FRAMES * 2;
+        if(b == ADD_BLOCKS / 2){
+            for(u32 n=0; n<ADD_NOTES; n++){
+                ks_synth_note_off(&notes[n]);
+            }
+        }
+        switch (mode) {
+        case ADD_RENDER:
+            for(u32 n=0; n<ADD_NOTES; n++){
+                ks_synth_render_buffered(ctx, rb, &notes[n], volume, ks_1(KS_LFO_DEPTH_BITS), tmp, ADD_FRAMES * 2);
+                for(u32 i=0; i<ADD_FRAMES * 2; i++){
+                    buf[i] += tmp[i];
+                }
+            }
+            break;
+        case ADD_NOTE:
+            for(u32 n=0; n<ADD_NOTES; n++){
+                ks_synth_render_add(ctx, rb, &notes[n], volume, ks_1(KS_LFO_DEPTH_BITS), buf, ADD_FRAMES * 2);
+            }
+            break;
+        case ADD_VOICES:{
+            // voices of a batch must be enabled
+            u32 begin = 0;
+            for(u32 n=1; n<=ADD_NOTES; n++){
+                if(n == ADD_NOTES || notes[n].synth != notes[begin].synth){
+                    ks_synth_note* enabled[ADD_NOTES];
+                    u32 num_enabled = 0;
+                    for(u32 e=begin; e<n; e++){
+                        if(ks_synth_note_is_enabled(&notes[e])) enabled[num_enabled++] = &notes[e];
+                    }
+                    if(num_enabled != 0){
+                        ks_synth_render_voices_add(ctx, rb, enabled, num_enabled, volume, ks_1(KS_LFO_DEPTH_BITS), buf, ADD_FRAMES * 2);
+                    }
+                    begin = n;
+                }
+            }
+            break;
+        }
+        case ADD_NOTES_ANY:
+            ks_synth_render_notes_add(ctx, rb, note_ptrs, ADD_NOTES, volume, ks_1(KS_LFO_DEPTH_BITS), buf, ADD_FRAMES * 2);
+            break;
+        }
+    }
+
+    free(tmp);
+    ks_synth_render_buffer_free(rb);
+    return out;
+}
+
+// accumulating render functions must be same as notes rendered one by one and added
+static bool test_add(void){
+    ks_synth_context* ctx = ks_synth_context_new(SAMPLING_RATE);
+    ctx->simd = KS_SIMD_NONE;
+    ks_tone_list* tones = ks_tone_list_new_from_data(ctx, &tone_list);
+    const ks_synth* synths[2] = { tones->data[0].programs[0], tones->data[0].programs[32] };
+    bool passed = true;
+
+    i32* expected = test_render_add(ctx, synths, ADD_RENDER);
+    const test_add_mode modes[] = { ADD_NOTE, ADD_VOICES, ADD_NOTES_ANY };
+    const char* names[] = { "ks_synth_render_add", "ks_synth_render_voices_add", "ks_synth_render_notes_add" };
+    for(u32 m=0; m<sizeof(modes)/sizeof(modes[0]); m++){
+        i32* actual = test_render_add(ctx, synths, modes[m]);
+        const bool equals = memcmp(expected, actual, sizeof(i32) * ADD_FRAMES * 2 * ADD_BLOCKS) == 0;
+        printf("result: %s is equals render and add = %s\n", names[m], equals ? "True" : "False");
+        passed = equals && passed;
+        free(actual);
+    }
+
+    free(expected);
+    ks_tone_list_free(tones);
+    ks_synth_context_free(ctx);
+    return passed;
+}
+
+int main( void )
+{
+    ks_score_data* score = test_score_new();
+    bool passed = true;
+
+    u32 expected_length;
+    i32* expected = test_render(score, KS_SIMD_NONE, 1, &expected_length);
+
+    printf("--- simd test ---\n");
+    {
+        // a new context uses the best instruction set of the machine
+        ks_synth_context* ctx = ks_synth_context_new(SAMPLING_RATE);
+        const ks_simd_t detected = ctx->simd;
+        ks_synth_context_free(ctx);
+
+        const ks_simd_t levels[] = { KS_SIMD_SSE2, KS_SIMD_AVX2, KS_SIMD_NEON };
+        const char* names[] = { "sse2", "avx2", "neon" };
+        for(u32 i=0; i<sizeof(levels)/sizeof(levels[0]); i++){
+            // x86 levels include lower ones, neon is alone
+            const bool available = detected == KS_SIMD_NEON ? levels[i] == KS_SIMD_NEON : levels[i] != KS_SIMD_NEON && levels[i] <= detected;
+            if(!available){
+                printf("%s is not available\n", names[i]);
+                continue;
+            }
+            u32 length;
+            i32* actual = test_render(score, levels[i], 1, &length);
+            passed = test_equals(names[i], expected, expected_length, actual, length) && passed;
+            free(actual);
+        }
+    }
+
+    printf("--- workers test ---\n");
+    {
+        const u32 workers[] = { 2, 3, 8 };
+        const char* names[] = { "2 workers", "3 workers", "8 workers" };
+        for(u32 i=0; i<sizeof(workers)/sizeof(workers[0]); i++){
+            u32 length;
+            i32* actual = test_render(score, KS_SIMD_NONE, workers[i], &length);
+            if(actual == NULL){
+                printf("workers are not available\n");
+                break;
+            }
+            passed = test_equals(names[i], expected, expected_length, actual, length) && passed;
+            free(actual);
+        }
+    }
+
+    printf("--- fused test ---\n");
+    passed = test_fused() && passed;
+
+    printf("--- add test ---\n");
+    passed = test_add() && passed;
+
+    free(expected);
+    ks_score_data_free(score);
+
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,376 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "../krsyn.h"
+
+#define SAMPLING_RATE   48000
+
+static const ks_tone_list_data tone_list =
+        #include "../tools/test_tones/test.kstc"
+;
+
+// score without events, notes are played by the test
+static ks_score_event empty_events[] = {
+    { .delta = 0xffffffff, .status = 0xff, .data = { 0x2f } },
+};
+static ks_score_data empty_score = {
+    .resolution = 96,
+    .length = 1,
+    .data = empty_events,
+};
+
+static ks_synth_context* ctx;
+static ks_tone_list* tones;
+
+static ks_score_state* test_state_new(u32 polyphony_bits){
+    ks_score_state* state = ks_score_state_new(polyphony_bits);
+    ks_score_state_set_default(state, tones, ctx, empty_score.resolution);
+    return state;
+}
+
+static void test_render(ks_score_state* state, u32 frames){
+    i32* buf = malloc(sizeof(i32) * frames * 2);
+    ks_score_data_render(&empty_score, ctx, state, tones, buf, frames * 2);
+    free(buf);
+}
+
+// index of the note keyed on last by channel and note number
+static u32 test_key_voice(const ks_score_state* state, u8 channel, u8 note_number){
+    return state->voices.key_voices[channel * KS_NUM_NOTES + note_number];
+}
+
+static bool test_note_is_on(const ks_score_state* state, u8 channel, u8 note_number){
+    const u32 index = test_key_voice(state, channel, note_number);
+    return index < (u32)ks_1(state->polyphony_bits) &&
+            state->voices.infos[index].channel == channel && state->voices.infos[index].note_number == note_number &&
+            ks_synth_note_is_on(&state->notes[index].note);
+}
+
+static bool test_result(const char* name, bool result){
+    printf("result: %s = %s\n", name, result ? "True" : "False");
+    return result;
+}
+
+// fills the pool of 4 notes with note 60 to 63 of channels, and then plays note 64 of channel 0.
+// returns the channel of the stolen note
+static i32 test_steal(ks_score_state* state, const u8 channels[4]){
+    for(u32 i=0; i<4; i++){
+        ks_score_state_note_on(state, ctx, channels[i], 60 + i, 100);
+    }
+    test_render(state, KS_SYNTH_TILE_FRAMES);
+
+    const u32 stolen_voices = state->stolen_voices;
+    if(!ks_score_state_note_on(state, ctx, 0, 64, 100) || state->stolen_voices != stolen_voices + 1 || state->voices.num_actives != 4){
+        return -1;
+    }
+    for(u32 i=0; i<4; i++){
+        if(!test_note_is_on(state, channels[i], 60 + i)) return i;
+    }
+    return -1;
+}
+
+static bool test_steal_policies(void){
+    bool passed = true;
+    {
+        // released note is stolen before older notes which are on
+        ks_score_state* state = test_state_new(2);
+        ks_score_state_note_on(state, ctx, 0, 60, 100);
+        ks_score_state_note_on(state, ctx, 0, 61, 100);
+        ks_score_state_note_on(state, ctx, 0, 62, 100);
+        ks_score_state_note_off(state, 0, 62);
+        ks_score_state_note_on(state, ctx, 0, 63, 100);
+        test_render(state, KS_SYNTH_TILE_FRAMES);
+        const u32 released = test_key_voice(state, 0, 62);
+
+        const bool on = ks_score_state_note_on(state, ctx, 0, 64, 100);
+        passed = test_result("oldest released steals released note", on && test_key_voice(state, 0, 64) == released &&
+                             test_note_is_on(state, 0, 60) && test_note_is_on(state, 0, 61) && test_note_is_on(state, 0, 63)) && passed;
+        ks_score_state_free(state);
+    }
+    {
+        // all notes are on, the oldest one is stolen
+        ks_score_state* state = test_state_new(2);
+        const i32 stolen = test_steal(state, (u8[]){ 0, 0, 0, 0 });
+        passed = test_result("oldest released steals oldest note", stolen == 0) && passed;
+        ks_score_state_free(state);
+    }
+    {
+        ks_score_state* state = test_state_new(2);
+        state->steal_policy = KS_SCORE_STEAL_QUIETEST;
+        ks_score_channel_set_volume(&state->channels[2], 10);
+        const i32 stolen = test_steal(state, (u8[]){ 0, 1, 2, 3 });
+        passed = test_result("quietest steals note of quiet channel", stolen == 2) && passed;
+        ks_score_state_free(state);
+    }
+    {
+        ks_score_state* state = test_state_new(2);
+        state->steal_policy = KS_SCORE_STEAL_LOWEST_PRIORITY;
+        for(u32 c=0; c<KS_NUM_CHANNELS; c++){
+            state->channel_priorities[c] = 10;
+        }
+        state->channel_priorities[3] = 0;
+        const i32 stolen = test_steal(state, (u8[]){ 0, 1, 2, 3 });
+        passed = test_result("lowest priority steals note of low priority channel", stolen == 3) && passed;
+        ks_score_state_free(state);
+    }
+    {
+        ks_score_state* state = test_state_new(2);
+        state->steal_policy = KS_SCORE_STEAL_NONE;
+        for(u32 i=0; i<4; i++){
+            ks_score_state_note_on(state, ctx, 0, 60 + i, 100);
+        }
+        const bool on = ks_score_state_note_on(state, ctx, 0, 64, 100);
+        passed = test_result("none drops new note", !on && state->stolen_voices == 0 && test_note_is_on(state, 0, 60)) && passed;
+        ks_score_state_free(state);
+    }
+    return passed;
+}
+
+static bool test_channel_voice_limits(void){
+    ks_score_state* state = test_state_new(4);
+    state->channel_voice_limits[0] = 2;
+
+    ks_score_state_note_on(state, ctx, 1, 50, 100);
+    ks_score_state_note_on(state, ctx, 0, 60, 100);
+    ks_score_state_note_on(state, ctx, 0, 61, 100);
+    ks_score_state_note_on(state, ctx, 0, 62, 100);
+
+    // the oldest note of the channel is stolen even if the pool has free notes
+    const bool passed = test_result("channel voice limit", state->voices.channel_voices[0] == 2 && state->stolen_voices == 1 &&
+                                    !test_note_is_on(state, 0, 60) && test_note_is_on(state, 0, 61) && test_note_is_on(state, 0, 62) &&
+                                    test_note_is_on(state, 1, 50));
+    ks_score_state_free(state);
+    return passed;
+}
+
+static bool test_key_voices(void){
+    bool passed = true;
+    {
+        ks_score_state* state = test_state_new(1);
+        ks_score_state_note_on(state, ctx, 0, 60, 100);
+        ks_score_state_note_off(state, 0, 60);
+        ks_score_state_note_on(state, ctx, 0, 61, 100);
+        // steals the released note 60, its key still points the reused note
+        ks_score_state_note_on(state, ctx, 0, 62, 100);
+        const bool reused = test_key_voice(state, 0, 60) == test_key_voice(state, 0, 62);
+        const bool off_stale = ks_score_state_note_off(state, 0, 60);
+        const bool off_reused = ks_score_state_note_off(state, 0, 62);
+        ks_score_state_note_on(state, ctx, 0, 60, 100);
+        const bool found = test_note_is_on(state, 0, 60) && ks_score_state_note_off(state, 0, 60) && !test_note_is_on(state, 0, 60);
+
+        passed = test_result("note is found after note off and reuse", reused && !off_stale && off_reused && found) && passed;
+        ks_score_state_free(state);
+    }
+    {
+        ks_score_state* state = test_state_new(4);
+        ks_score_state_note_on(state, ctx, 1, 60, 100);
+        ks_score_state_note_on(state, ctx, 0, 61, 100);
+        ks_score_state_note_off(state, 0, 61);
+
+        passed = test_result("channel 1 note 60 and channel 0 note 61 do not collide",
+                             test_key_voice(state, 1, 60) != test_key_voice(state, 0, 61) &&
+                             test_note_is_on(state, 1, 60) && !test_note_is_on(state, 0, 61)) && passed;
+        ks_score_state_free(state);
+    }
+    return passed;
+}
+
+static bool test_percussion(void){
+    bool passed = true;
+    {
+        ks_score_state* state = test_state_new(4);
+        ks_score_state_set_gs_percussion(state);
+        bool single = true;
+        for(u32 i=0; i<8; i++){
+            ks_score_state_note_on(state, ctx, 9, 38, 100);
+            test_render(state, KS_SYNTH_TILE_FRAMES);
+            single = single && state->voices.num_actives == 1;
+        }
+        passed = test_result("retriggered note keeps a voice", single && state->stolen_voices == 0) && passed;
+        ks_score_state_free(state);
+    }
+    {
+        const u32 choke_frames = SAMPLING_RATE * KS_SCORE_CHOKE_MSEC / 1000 + KS_SYNTH_TILE_FRAMES;
+        bool open_enabled[2];
+        for(u32 i=0; i<2; i++){
+            ks_score_state* state = test_state_new(4);
+            if(i == 1){
+                ks_score_state_set_gs_percussion(state);
+            }
+            // open hi-hat, and then closed hi-hat of the same group
+            ks_score_state_note_on(state, ctx, 9, 46, 100);
+            test_render(state, KS_SYNTH_TILE_FRAMES);
+            const u32 open = test_key_voice(state, 9, 46);
+            ks_score_state_note_on(state, ctx, 9, 42, 100);
+            test_render(state, choke_frames);
+            open_enabled[i] = ks_synth_note_is_enabled(&state->notes[open].note);
+            ks_score_state_free(state);
+        }
+        passed = test_result("closed hi-hat chokes open hi-hat", open_enabled[0] && !open_enabled[1]) && passed;
+    }
+    return passed;
+}
+
+// plays a note of channel 0 for frames, muted if mute, and then renders frames of the note unmuted to buf.
+// returns false if the channel is not silent while it is muted
+static bool test_render_unmuted(bool mute, i32* buf, u32 frames){
+    ks_score_state* state = test_state_new(4);
+    ks_score_state_note_on(state, ctx, 0, 60, 100);
+    state->muted_channels = mute ? ks_1(0) : 0;
+    ks_score_data_render(&empty_score, ctx, state, tones, buf, frames * 2);
+    bool silent = true;
+    for(u32 i=0; i<frames * 2; i++){
+        silent = silent && buf[i] == 0;
+    }
+
+    state->muted_channels = 0;
+    ks_score_data_render(&empty_score, ctx, state, tones, buf, frames * 2);
+    ks_score_state_free(state);
+    return !mute || silent;
+}
+
+static bool test_virtual_voices(void){
+    const u32 frames = KS_SYNTH_TILE_FRAMES * 32;
+    i32* expected = malloc(sizeof(i32) * frames * 2);
+    i32* actual = malloc(sizeof(i32) * frames * 2);
+    test_render_unmuted(false, expected, frames);
+    const bool silent = test_render_unmuted(true, actual, frames);
+
+    // virtual notes skip at control rate without filter history, so the first tile after unmuting may differ.
+    // after that, the note must sound as it has been audible, within 1 % of energy
+    double energy = 0, error = 0;
+    for(u32 i=KS_SYNTH_TILE_FRAMES * 2; i<frames * 2; i++){
+        energy += (double)expected[i] * expected[i];
+        error += ((double)actual[i] - expected[i]) * ((double)actual[i] - expected[i]);
+    }
+    free(expected);
+    free(actual);
+    return test_result("unmuted note sounds as not muted", silent && energy > 0 && error < energy / 100);
+}
+
+static bool test_silence_threshold(void){
+    const u32 num_voices = ks_1(4);
+    bool retired[2], freed[2];
+    for(u32 i=0; i<2; i++){
+        ks_score_state* state = test_state_new(4);
+        // release of program 32 lasts about 95 tiles, and falls under 1/16 of full scale in about 70 tiles
+        state->silence_threshold = i == 1 ? ks_1(KS_ENVELOPE_BITS - 4) : 0;
+        ks_score_state_program_change(state, tones, 0, 32);
+        ks_score_state_note_on(state, ctx, 0, 60, 100);
+        test_render(state, KS_SYNTH_TILE_FRAMES * 32);
+        ks_score_state_note_off(state, 0, 60);
+        test_render(state, KS_SYNTH_TILE_FRAMES * 80);
+        // the note ended in the last block is freed at next block
+        test_render(state, KS_SYNTH_TILE_FRAMES);
+        retired[i] = state->retired_voices == 1;
+        freed[i] = state->voices.num_actives == 0 && state->voices.num_frees == num_voices;
+        ks_score_state_free(state);
+    }
+    return test_result("silent released note is retired and freed", !retired[0] && !freed[0] && retired[1] && freed[1]);
+}
+
+// sparse score of notes and tempo changes, quarter time is in 1/256 seconds
+static const ks_score_event sparse_events[] = {
+    { .delta = 0,   .status = 0xff, .data = { 0x51, 128, 0 } },
+    { .delta = 0,   .status = 0x90, .data = { 60, 100 } },
+    { .delta = 37,  .status = 0x91, .data = { 67, 90 } },
+    { .delta = 11,  .status = 0xff, .data = { 0x51, 64, 0 } },
+    { .delta = 5,   .status = 0x80, .data = { 60, 0 } },
+    { .delta = 90,  .status = 0xff, .data = { 0x51, 0, 1 } },
+    { .delta = 1,   .status = 0x90, .data = { 64, 80 } },
+    { .delta = 23,  .status = 0xff, .data = { 0x51, 200, 0 } },
+    { .delta = 0,   .status = 0x81, .data = { 67, 0 } },
+    { .delta = 61,  .status = 0x80, .data = { 64, 0 } },
+    { .delta = 7,   .status = 0xff, .data = { 0x51, 13, 0 } },
+    { .delta = 40,  .status = 0x90, .data = { 72, 100 } },
+    { .delta = 130, .status = 0x80, .data = { 72, 0 } },
+    { .delta = 48,  .status = 0xff, .data = { 0x2f } },
+};
+
+// same as sparse_events, with text events at every tick between them, so that every tick is rendered alone
+static ks_score_data* test_dense_score_new(void){
+    const u32 num_sparse = sizeof(sparse_events) / sizeof(sparse_events[0]);
+    u32 num_events = 0;
+    for(u32 e=0; e<num_sparse; e++){
+        num_events += MAX(sparse_events[e].delta, 1u);
+    }
+    ks_score_event* events = malloc(sizeof(ks_score_event) * num_events);
+    u32 n = 0;
+    for(u32 e=0; e<num_sparse; e++){
+        for(u32 t=1; t<sparse_events[e].delta; t++){
+            events[n++] = (ks_score_event){ .delta = 1, .status = 0xff, .data = { 0x01 } };
+        }
+        events[n] = sparse_events[e];
+        events[n].delta = MIN(sparse_events[e].delta, 1u);
+        n++;
+    }
+    return ks_score_data_new(48, n, events);
+}
+
+static i32* test_render_score(const ks_score_data* score, u32* length){
+    ks_score_state* state = ks_score_state_new(4);
+    ks_score_state_set_default(state, tones, ctx, score->resolution);
+
+    // not a multiple of tiles nor ticks
+    const u32 len = 1000;
+    u32 capacity = len * 64, num_samples = 0;
+    i32* out = malloc(sizeof(i32) * capacity);
+    while(state->passed_tick >= 0){
+        if(num_samples + len > capacity){
+            capacity *= 2;
+            out = realloc(out, sizeof(i32) * capacity);
+        }
+        ks_score_data_render(score, ctx, state, tones, out + num_samples, len);
+        num_samples += len;
+    }
+    *length = num_samples;
+    ks_score_state_free(state);
+    return out;
+}
+
+static bool test_tempo_changes(void){
+    ks_score_data* sparse = ks_score_data_new(48, sizeof(sparse_events) / sizeof(sparse_events[0]),
+                                              ks_score_events_new(sizeof(sparse_events) / sizeof(sparse_events[0]), (ks_score_event*)sparse_events));
+    ks_score_data* dense = test_dense_score_new();
+
+    u32 expected_length, actual_length;
+    i32* expected = test_render_score(dense, &expected_length);
+    i32* actual = test_render_score(sparse, &actual_length);
+    const bool passed = test_result("sparse score with tempo changes is same as rendered tick by tick",
+                                    expected_length == actual_length && memcmp(expected, actual, sizeof(i32) * expected_length) == 0);
+
+    free(expected);
+    free(actual);
+    ks_score_data_free(sparse);
+    ks_score_data_free(dense);
+    return passed;
+}
+
+int main( void )
+{
+    ctx = ks_synth_context_new(SAMPLING_RATE);
+    tones = ks_tone_list_new_from_data(ctx, &tone_list);
+    bool passed = true;
+
+    printf("--- voice management test ---\n");
+    passed = test_steal_policies() && passed;
+    passed = test_channel_voice_limits() && passed;
+    passed = test_key_voices() && passed;
+
+    printf("--- percussion test ---\n");
+    passed = test_percussion() && passed;
+
+    printf("--- virtual voices test ---\n");
+    passed = test_virtual_voices() && passed;
+
+    printf("--- silence threshold test ---\n");
+    passed = test_silence_threshold() && passed;
+
+    printf("--- tempo change test ---\n");
+    passed = test_tempo_changes() && passed;
+
+    ks_tone_list_free(tones);
+    ks_synth_context_free(ctx);
+
+    return passed ? 0 : 1;
+}
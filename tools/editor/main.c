@@ -47,6 +47,7 @@ typedef struct editor_state{
     ks_synth_data temp_synth;
     ks_synth synth;
     ks_synth_note note;
+    ks_synth_render_buffer* render_buffer;
 
     ks_score_data score;
     ks_score_state* score_state;
@@ -294,7 +295,7 @@ void EditorUpdate(void* ptr){
         i32 tmpbuf[BUFFER_LENGTH_PER_UPDATE];
         memset(tmpbuf, 0, sizeof(tmpbuf));
         if(es->note.synth && es->note.synth->enabled){
-            ks_synth_render(es->ctx, &es->note, ks_1(KS_VOLUME_BITS), ks_1(KS_LFO_DEPTH_BITS), tmpbuf, BUFFER_LENGTH_PER_UPDATE);
+            ks_synth_render_buffered(es->ctx, es->render_buffer, &es->note, ks_1(KS_VOLUME_BITS), ks_1(KS_LFO_DEPTH_BITS), tmpbuf, BUFFER_LENGTH_PER_UPDATE);
 
             for(unsigned i=0; i< BUFFER_LENGTH_PER_UPDATE; i++){
                 es->buf[i] += tmpbuf[i] / (float)INT16_MAX;
@@ -1614,6 +1615,7 @@ void init(editor_state* es){
     es->testbox_focus = -1;
     es->current_tone_index =-1;
     memset(&es->note, 0, sizeof(es->note));
+    es->render_buffer = ks_synth_render_buffer_new(KS_SYNTH_TILE_FRAMES, 1);
     es->noteon_number = -1;
     es->dirty = false;
     es->display_mode= EDIT;
@@ -1674,6 +1676,7 @@ void deinit(editor_state* es){
     CloseAudioDevice();
 
     ks_synth_context_free(es->ctx);
+    ks_synth_render_buffer_free(es->render_buffer);
 
     ks_score_state_free(es->score_state);
 #ifdef PLATFORM_DESKTOP
@@ -187,6 +187,7 @@ void init(player_state* ps){
     ps->ctx = ks_synth_context_new(SAMPLING_RATE);
     ps->score = ks_score_data_new(96, 0, NULL);
     ps->score_state = ks_score_state_new(POLYPHONY_BITS);
+    ks_score_state_set_gs_percussion(ps->score_state);
     ps->tones_data = &default_tone_list;
     ps->tones = ks_tone_list_new_from_data(ps->ctx, ps->tones_data);
 
@@ -408,7 +409,7 @@ void update(void* ptr){
             int p = 0;
             for(int i=0; i<ks_1(POLYPHONY_BITS); i++)
             {
-                if(ks_score_note_is_enabled(ps->score_state->notes + i)){
+                if(ks_score_state_voice_is_enabled(ps->score_state, i)){
                             p++;
                 }
             }
@@ -0,0 +1,314 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+#include <krsyn.h>
+#include <ksio/io.h>
+#include <ksio/serial/clike.h>
+#include <ksio/serial/binary.h>
+#include <ksio/formats/midi.h>
+
+
+#define SAMPLING_RATE               48000
+#define POLYPHONY_BITS              8
+#define TAIL_SECONDS                2
+
+#define SAMPLES_PER_RENDER          4096
+#define BUFFER_CHANNELS             2
+#define BUFFER_LENGTH_PER_RENDER    (SAMPLES_PER_RENDER*BUFFER_CHANNELS)
+
+#define WAVE_HEADER_SIZE            44
+
+typedef enum render_format{
+    FORMAT_WAV,
+    FORMAT_RAW,
+} render_format;
+
+typedef struct render_options{
+    const char*     score_file;
+    const char*     tones_file;
+    const char*     output_file;
+    render_format   format;
+    u32             sampling_rate;
+    u32             polyphony_bits;
+    u32             num_workers;
+    u32             tail_seconds;
+    u16             voice_budget;
+    bool            gs_percussion;
+} render_options;
+
+static const ks_tone_list_data default_tone_list=
+        #include "../test_tones/test.kstc"
+;
+
+static void usage(const char* name){
+    fprintf(stderr,
+            "Usage: %s [options] score [tones]\n"
+            "  score         *.mid *.midi *.kscb *.kscc\n"
+            "  tones         *.kstb *.kstc, test tones if omitted\n"
+            "Options:\n"
+            "  -o file       output file, - : stdout (default: output.wav or output.raw)\n"
+            "  -f wav|raw    output format, raw is 16 bit little endian stereo (default: wav)\n"
+            "  -r rate       sampling rate (default: %u)\n"
+            "  -p bits       polyphony bits (default: %u)\n"
+            "  -w workers    number of worker threads, 0 : render on the caller (default: 0)\n"
+            "  -b voices     maximum number of audible notes, 0 : no limit (default: 0)\n"
+            "  -t seconds    maximum length of release tails after the end of score (default: %u)\n"
+            "  -g 0|1        retrigger percussion and choke GS exclusive classes such as hi-hats (default: 1)\n",
+            name, SAMPLING_RATE, POLYPHONY_BITS, TAIL_SECONDS);
+}
+
+static const char* file_extension(const char* file){
+    const char* dot = strrchr(file, '.');
+    return dot == NULL ? "" : dot + 1;
+}
+
+static ks_score_data* load_score(const char* file){
+    const char* ext = file_extension(file);
+
+    if(strcmp(ext,  "mid")  == 0 || strcmp(ext,"midi") == 0 ){
+        ks_midi_file midi = { 0 };
+        ks_score_data* score = NULL;
+        if(!ks_io_deserialize_from_file(binary_big_endian, file, midi, ks_midi_file)){
+            ks_error("Failed to load midi file \"%s\"", file);
+        } else {
+            score = ks_score_data_from_midi(&midi);
+        }
+        ks_midi_tracks_free(midi.num_tracks, midi.tracks);
+        return score;
+    }
+    else if(strcmp(ext, "kscb") == 0 || strcmp(ext, "kscc") == 0){
+        ks_score_data* score = ks_score_data_new(0,0, 0);
+        const bool loaded = strcmp(ext, "kscb") == 0 ?
+                    ks_io_deserialize_from_file(binary_big_endian, file, *score, ks_score_data) :
+                    ks_io_deserialize_from_file(clike, file, *score, ks_score_data);
+        if(!loaded){
+            ks_error("Failed to load krsyn score file \"%s\"", file);
+            ks_score_data_free(score);
+            return NULL;
+        }
+        return score;
+    }
+
+    ks_error("Invalid score file type. Extention must be one of the following:\n\t\t*.mid *.midi *.kscb *.kscc");
+    return NULL;
+}
+
+static ks_tone_list_data* load_tones(const char* file){
+    const char* ext = file_extension(file);
+
+    if(strcmp(ext, "kstb") == 0 || strcmp(ext, "kstc") == 0){
+        ks_tone_list_data* dat = ks_tone_list_data_new();
+        const bool loaded = strcmp(ext, "kstb") == 0 ?
+                    ks_io_deserialize_from_file(binary_big_endian, file, *dat, ks_tone_list_data) :
+                    ks_io_deserialize_from_file(clike, file, *dat, ks_tone_list_data);
+        if(!loaded){
+            ks_error("Failed to load krsyn tone list file \"%s\"", file);
+            ks_tone_list_data_free(dat);
+            return NULL;
+        }
+        return dat;
+    }
+
+    ks_error("Invalid tone list file type. Extention must be one of the following:\n\t\t*.kstb *.kstc");
+    return NULL;
+}
+
+static bool parse_options(render_options* opt, int argc, char** argv){
+    *opt = (render_options){
+        .format = FORMAT_WAV,
+        .sampling_rate = SAMPLING_RATE,
+        .polyphony_bits = POLYPHONY_BITS,
+        .num_workers = 0,
+        .tail_seconds = TAIL_SECONDS,
+        .voice_budget = 0,
+        .gs_percussion = true,
+    };
+
+    for(int i=1; i<argc; i++){
+        const char* arg = argv[i];
+        if(arg[0] != '-' || arg[1] == '\0'){
+            if(opt->score_file == NULL) opt->score_file = arg;
+            else if(opt->tones_file == NULL) opt->tones_file = arg;
+            else return false;
+            continue;
+        }
+        if(arg[2] != '\0' || i+1 >= argc) return false;
+
+        const char* value = argv[++i];
+        switch (arg[1]) {
+        case 'o':
+            opt->output_file = value;
+            break;
+        case 'f':
+            if(strcmp(value, "wav") == 0) opt->format = FORMAT_WAV;
+            else if(strcmp(value, "raw") == 0) opt->format = FORMAT_RAW;
+            else return false;
+            break;
+        case 'r':
+            opt->sampling_rate = strtoul(value, NULL, 10);
+            if(opt->sampling_rate == 0) return false;
+            break;
+        case 'p':
+            opt->polyphony_bits = strtoul(value, NULL, 10);
+            if(opt->polyphony_bits == 0 || opt->polyphony_bits > 16) return false;
+            break;
+        case 'w':
+            opt->num_workers = strtoul(value, NULL, 10);
+            break;
+        case 'b':
+            opt->voice_budget = MIN(strtoul(value, NULL, 10), UINT16_MAX);
+            break;
+        case 't':
+            opt->tail_seconds = strtoul(value, NULL, 10);
+            break;
+        case 'g':
+            opt->gs_percussion = strtoul(value, NULL, 10) != 0;
+            break;
+        default:
+            return false;
+        }
+    }
+
+    if(opt->output_file == NULL){
+        opt->output_file = opt->format == FORMAT_WAV ? "output.wav" : "output.raw";
+    }
+    return opt->score_file != NULL;
+}
+
+static void write_u16le(u8* dest, u16 value){
+    dest[0] = value & 0xff;
+    dest[1] = value >> 8;
+}
+
+static void write_u32le(u8* dest, u32 value){
+    write_u16le(dest, value & 0xffff);
+    write_u16le(dest + 2, value >> 16);
+}
+
+// 16 bit pcm header, sizes are fixed up after rendering if the output is seekable
+static void write_wave_header(FILE* f, u32 sampling_rate, u32 data_size){
+    u8 header[WAVE_HEADER_SIZE];
+    memcpy(header, "RIFF", 4);
+    write_u32le(header + 4, data_size + WAVE_HEADER_SIZE - 8);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    write_u32le(header + 16, 16);
+    write_u16le(header + 20, 1);
+    write_u16le(header + 22, BUFFER_CHANNELS);
+    write_u32le(header + 24, sampling_rate);
+    write_u32le(header + 28, sampling_rate * BUFFER_CHANNELS * sizeof(i16));
+    write_u16le(header + 32, BUFFER_CHANNELS * sizeof(i16));
+    write_u16le(header + 34, 16);
+    memcpy(header + 36, "data", 4);
+    write_u32le(header + 40, data_size);
+    fwrite(header, 1, WAVE_HEADER_SIZE, f);
+}
+
+static double now_seconds(void){
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char** argv){
+    render_options opt;
+    if(!parse_options(&opt, argc, argv)){
+        usage(argv[0]);
+        return 1;
+    }
+
+    ks_score_data* score = load_score(opt.score_file);
+    if(score == NULL) return 1;
+
+    const ks_tone_list_data* tones_data = &default_tone_list;
+    if(opt.tones_file != NULL){
+        tones_data = load_tones(opt.tones_file);
+        if(tones_data == NULL){
+            ks_score_data_free(score);
+            return 1;
+        }
+    }
+
+    FILE* out = strcmp(opt.output_file, "-") == 0 ? stdout : fopen(opt.output_file, "wb");
+#ifdef _WIN32
+    // stdout is opened in text mode, which converts line feeds
+    if(out == stdout) _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    if(out == NULL){
+        ks_error("Failed to open output file \"%s\"", opt.output_file);
+        ks_score_data_free(score);
+        if(tones_data != &default_tone_list) ks_tone_list_data_free((ks_tone_list_data*)tones_data);
+        return 1;
+    }
+
+    ks_synth_context* ctx = ks_synth_context_new(opt.sampling_rate);
+    ks_tone_list* tones = ks_tone_list_new_from_data(ctx, tones_data);
+    ks_score_state* state = ks_score_state_new(opt.polyphony_bits);
+    ks_score_state_set_default(state, tones, ctx, score->resolution);
+    state->voice_budget = opt.voice_budget;
+    if(opt.gs_percussion){
+        ks_score_state_set_gs_percussion(state);
+    }
+    if(opt.num_workers != 0 && !ks_score_state_set_workers(state, opt.num_workers)){
+        ks_warning("Workers are not available, render on the main thread");
+    }
+
+    i32* buf = malloc(sizeof(i32) * BUFFER_LENGTH_PER_RENDER);
+    u8* write_buf = malloc(sizeof(i16) * BUFFER_LENGTH_PER_RENDER);
+
+    if(opt.format == FORMAT_WAV){
+        write_wave_header(out, opt.sampling_rate, 0);
+    }
+
+    const double begin = now_seconds();
+    const u64 max_tail_frames = (u64)opt.tail_seconds * opt.sampling_rate;
+    u64 frames = 0, tail_frames = 0;
+    bool failed = false;
+
+    // render until the end of score, and then until release tails end
+    while(state->passed_tick >= 0 || (tail_frames < max_tail_frames && state->voices.num_actives != 0)){
+        const bool tail = state->passed_tick < 0;
+        ks_score_data_render(score, ctx, state, tones, buf, BUFFER_LENGTH_PER_RENDER);
+
+        for(u32 i=0; i<BUFFER_LENGTH_PER_RENDER; i++){
+            const i32 sample = buf[i] >> 1;
+            write_u16le(write_buf + i*sizeof(i16), (u16)MAX(MIN(sample, INT16_MAX), INT16_MIN));
+        }
+        if(fwrite(write_buf, sizeof(i16), BUFFER_LENGTH_PER_RENDER, out) != BUFFER_LENGTH_PER_RENDER){
+            ks_error("Failed to write output file \"%s\"", opt.output_file);
+            failed = true;
+            break;
+        }
+
+        frames += SAMPLES_PER_RENDER;
+        if(tail) tail_frames += SAMPLES_PER_RENDER;
+    }
+
+    const double elapsed = now_seconds() - begin;
+
+    if(!failed && opt.format == FORMAT_WAV && out != stdout && fseek(out, 0, SEEK_SET) == 0){
+        write_wave_header(out, opt.sampling_rate, MIN(frames * BUFFER_CHANNELS * sizeof(i16), UINT32_MAX - WAVE_HEADER_SIZE));
+    }
+    if(out != stdout) fclose(out);
+    else fflush(out);
+
+    const double seconds = (double)frames / opt.sampling_rate;
+    fprintf(stderr, "%s : %.3f sec rendered in %.3f sec (realtime x%.1f), peak voices %u audible %u virtual, stolen voices %u\n",
+            opt.score_file, seconds, elapsed, elapsed > 0 ? seconds / elapsed : 0.0,
+            state->peak_voices, state->peak_virtual_voices, state->stolen_voices);
+
+    free(buf);
+    free(write_buf);
+    ks_score_state_free(state);
+    ks_tone_list_free(tones);
+    ks_synth_context_free(ctx);
+    ks_score_data_free(score);
+    if(tones_data != &default_tone_list) ks_tone_list_data_free((ks_tone_list_data*)tones_data);
+
+    return failed ? 1 : 0;
+}